@@ -0,0 +1,226 @@
+/***************************************************************
+ ** Copyright (C) 2021 Aron Homberg
+ **
+ ** You may also use this code under the terms of the
+ ** GPL v3 (see www.gnu.org/licenses).
+ ** MICROTUNE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL
+ ** WARRANTIES, WHETHER EXPRESSED OR IMPLIED, INCLUDING
+ ** MERCHANTABILITY AND FITNESS FOR PURPOSE, ARE DISCLAIMED.
+ ***************************************************************/
+
+#include "Constants.h"
+#include "PluginProcessor.h"
+
+#include <cstdio>
+
+// access to the internals that audioapp_bench measures in isolation (friend of the measured classes)
+struct BenchmarkAccess {
+    static void processMidiEvents(AppAudioProcessor& processor, const juce::MidiBuffer& midiBuffer,
+                                  juce::MidiBuffer& output, bool dispatchPerEvent) {
+        processor.processMidiEventsOnly(midiBuffer, output, dispatchPerEvent);
+    }
+
+    static void prepareCalibration(PitchCalibrator& calibrator, double sampleRate) {
+        calibrator.prepare(sampleRate);
+        calibrator.allocate();
+    }
+
+    static int getCalibrationHopSize(const PitchCalibrator& calibrator) {
+        return calibrator.getHopSize();
+    }
+
+    static float analyseCalibrationHop(PitchCalibrator& calibrator, const float* samples) {
+        return calibrator.analyseHop(samples);
+    }
+};
+
+namespace {
+    constexpr int kStateIterations = 10000;
+
+    constexpr double kSampleRate = 48000.0;
+    constexpr int kBlockSize = 512;
+    constexpr int kEventsPerBlock = 64;
+    constexpr int kKernelIterations = 20000;
+
+    constexpr int kCalibrationHops = 8;
+    constexpr int kCalibrationIterations = 500;
+
+    // runs fn the given number of times and returns the mean time per call in microseconds
+    template <typename Fn>
+    double measureMicroseconds(int iterations, Fn&& fn) {
+        auto start = juce::Time::getHighResolutionTicks();
+
+        for (int i = 0; i < iterations; i++) {
+            fn();
+        }
+
+        auto elapsed = juce::Time::getHighResolutionTicks() - start;
+
+        return juce::Time::highResolutionTicksToSeconds(elapsed) * 1000000.0 / iterations;
+    }
+
+    // detunes every tone, so that the state doesn't only consist of default values
+    void randomiseParameters(AppAudioProcessor& processor) {
+        juce::Random random (42);
+
+        for (auto* parameter : processor.getParameters()) {
+            parameter->setValueNotifyingHost(random.nextFloat());
+        }
+    }
+
+    void setParameter(AppAudioProcessor& processor, const juce::String& paramId, float plainValue) {
+        for (auto* parameter : processor.getParameters()) {
+            if (auto* ranged = dynamic_cast<juce::RangedAudioParameter*>(parameter)) {
+                if (ranged->paramID == paramId) {
+                    ranged->setValueNotifyingHost(ranged->convertTo0to1(plainValue));
+                }
+            }
+        }
+    }
+
+    // one block of played notes: note-ons, pitch wheel movements and note-offs spread over the block
+    juce::MidiBuffer createMidiBlock() {
+        juce::MidiBuffer midiBuffer;
+        juce::Random random (42);
+
+        for (int i = 0; i < kEventsPerBlock; i++) {
+            auto samplePosition = i * kBlockSize / kEventsPerBlock;
+            auto noteNumber = 36 + random.nextInt(48);
+
+            switch (i % 3) {
+                case 0:
+                    midiBuffer.addEvent(juce::MidiMessage::noteOn(1, noteNumber, 0.8f), samplePosition);
+                    break;
+                case 1:
+                    midiBuffer.addEvent(juce::MidiMessage::pitchWheel(1, random.nextInt(16384)), samplePosition);
+                    break;
+                default:
+                    midiBuffer.addEvent(juce::MidiMessage::noteOff(1, noteNumber), samplePosition);
+                    break;
+            }
+        }
+
+        return midiBuffer;
+    }
+
+    // time per event of every processing kernel specialisation (see OutputModes.h), picked once per block,
+    // compared to checking the output mode and bend range for every event. Only the kernel is timed,
+    // not the rest of processBlock
+    void benchmarkKernels(AppAudioProcessor& processor) {
+        struct KernelConfig {
+            const char* name;
+            float outputMode;
+            float bendRange;
+        };
+
+        const KernelConfig configs[] = {
+            { "global bend, +/-1 semitone", 0.0f, 0.0f },
+            { "global bend, +/-2 semitones", 0.0f, 1.0f },
+            { "global bend, +/-12 semitones", 0.0f, 2.0f },
+            { "pass-through", 1.0f, 0.0f },
+        };
+
+        processor.prepareToPlay(kSampleRate, kBlockSize);
+
+        const auto inputBlock = createMidiBlock();
+        juce::MidiBuffer outputBuffer;
+        outputBuffer.ensureSize(4096);
+
+        std::printf("kernels (per event, %d events per block of %d samples)\n", kEventsPerBlock, kBlockSize);
+        std::printf("  %-30s %11s %11s\n", "", "specialised", "runtime");
+
+        for (const auto& config : configs) {
+            setParameter(processor, "outputMode", config.outputMode);
+            setParameter(processor, "bendRange", config.bendRange);
+
+            auto measureKernel = [&](bool dispatchPerEvent) {
+                return measureMicroseconds(kKernelIterations, [&] {
+                    outputBuffer.clear();
+                    BenchmarkAccess::processMidiEvents(processor, inputBlock, outputBuffer, dispatchPerEvent);
+                }) * 1000.0 / kEventsPerBlock;
+            };
+
+            auto specialised = measureKernel(false);
+            auto dispatchedPerEvent = measureKernel(true);
+
+            std::printf("  %-30s %8.1f ns %8.1f ns\n", config.name, specialised, dispatchedPerEvent);
+        }
+    }
+
+    // compares the binary state format with the XML state of the MagicProcessor
+    void benchmarkState(AppAudioProcessor& processor) {
+        juce::MemoryBlock binaryState;
+        juce::MemoryBlock xmlState;
+
+        processor.getStateInformation(binaryState);
+        processor.foleys::MagicProcessor::getStateInformation(xmlState);
+
+        auto binarySerialize = measureMicroseconds(kStateIterations, [&] {
+            processor.getStateInformation(binaryState);
+        });
+
+        auto binaryDeserialize = measureMicroseconds(kStateIterations, [&] {
+            processor.setStateInformation(binaryState.getData(), (int) binaryState.getSize());
+        });
+
+        auto xmlSerialize = measureMicroseconds(kStateIterations, [&] {
+            processor.foleys::MagicProcessor::getStateInformation(xmlState);
+        });
+
+        // setStateInformation falls back to the XML path for anything that isn't binary state
+        auto xmlDeserialize = measureMicroseconds(kStateIterations, [&] {
+            processor.setStateInformation(xmlState.getData(), (int) xmlState.getSize());
+        });
+
+        std::printf("state (per instance, mean of %d runs)\n", kStateIterations);
+        std::printf("  binary v%d: %6d bytes, serialize %9.3f us, deserialize %9.3f us\n",
+                    APP_SERIALIZE_CURRENT_VERSION, (int) binaryState.getSize(), binarySerialize, binaryDeserialize);
+        std::printf("  xml       : %6d bytes, serialize %9.3f us, deserialize %9.3f us\n",
+                    (int) xmlState.getSize(), xmlSerialize, xmlDeserialize);
+    }
+
+    // analysis time of the calibration pitch detector, compared to the duration of the audio it analyses.
+    // Above 1x real time, one core keeps up with the input
+    void benchmarkCalibration() {
+        std::printf("calibration pitch detection (one core, per hop)\n");
+
+        for (auto sampleRate : { 48000.0, 96000.0 }) {
+            PitchCalibrator calibrator { juce::Value() };
+            BenchmarkAccess::prepareCalibration(calibrator, sampleRate);
+
+            const int hopSize = BenchmarkAccess::getCalibrationHopSize(calibrator);
+
+            // a tone with a few harmonics, the search runs over all lags anyway
+            std::vector<float> input ((size_t) (hopSize * kCalibrationHops));
+
+            for (size_t i = 0; i < input.size(); i++) {
+                auto phase = juce::MathConstants<double>::twoPi * 220.0 * (double) i / sampleRate;
+                input[i] = (float) (0.5 * std::sin(phase) + 0.25 * std::sin(2.0 * phase) + 0.125 * std::sin(3.0 * phase));
+            }
+
+            int hop = 0;
+
+            auto perHop = measureMicroseconds(kCalibrationIterations, [&] {
+                BenchmarkAccess::analyseCalibrationHop(calibrator, input.data() + hopSize * (hop++ % kCalibrationHops));
+            });
+
+            auto hopDuration = hopSize / sampleRate * 1000000.0;
+
+            std::printf("  %3.0f kHz: %9.1f us for %6.1f ms of audio, %6.1fx real time\n",
+                        sampleRate / 1000.0, perHop, hopDuration / 1000.0, hopDuration / perHop);
+        }
+    }
+} // namespace
+
+int main() {
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+
+    AppAudioProcessor processor;
+    randomiseParameters(processor);
+
+    benchmarkState(processor);
+    benchmarkKernels(processor);
+    benchmarkCalibration();
+
+    return 0;
+}
@@ -0,0 +1,508 @@
+/***************************************************************
+ ** Copyright (C) 2021 Aron Homberg
+ **
+ ** You may also use this code under the terms of the
+ ** GPL v3 (see www.gnu.org/licenses).
+ ** MICROTUNE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL
+ ** WARRANTIES, WHETHER EXPRESSED OR IMPLIED, INCLUDING
+ ** MERCHANTABILITY AND FITNESS FOR PURPOSE, ARE DISCLAIMED.
+ ***************************************************************/
+
+#include "Constants.h"
+#include "PluginProcessor.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#if JUCE_LINUX
+ #include <unistd.h>
+#endif
+
+/* Multi-instance stress harness: creates N processors and drives them on a pool of worker threads,
+   one audio cycle at a time, the way a multi-core host does. Every instance gets its own MIDI stream
+   and random parameter automation. In a second parallel phase, the workers also request preset operations
+   (save, load, remove) from a message thread stand-in, which runs them on the settings (and settings file)
+   shared by all instances while the blocks are processed.
+
+   audioapp_stress [--instances 64] [--threads <cores>] [--seconds 10] [--block-size 512]
+                   [--sample-rate 48000] [--preset-share 0.01] [--no-realtime] */
+
+namespace {
+    struct Options {
+        int numInstances = 64;
+        int numThreads = juce::SystemStats::getNumCpus();
+        double seconds = 10.0;
+        int blockSize = 512;
+        double sampleRate = 48000.0;
+
+        // share of blocks followed by a preset operation in the preset phase
+        double presetShare = 0.01;
+
+        // paces the cycles like an audio device would, otherwise runs as fast as possible
+        bool realtime = true;
+    };
+
+    // the single threaded reference run is kept short
+    constexpr double kReferenceSeconds = 2.0;
+
+    Options parseOptions(const juce::StringArray& args) {
+        Options options;
+
+        for (int i = 0; i < args.size(); i++) {
+            auto value = args[i + 1];
+
+            if (args[i] == "--instances") options.numInstances = juce::jmax(1, value.getIntValue());
+            if (args[i] == "--threads") options.numThreads = juce::jmax(1, value.getIntValue());
+            if (args[i] == "--seconds") options.seconds = juce::jmax(0.1, value.getDoubleValue());
+            if (args[i] == "--block-size") options.blockSize = juce::jmax(16, value.getIntValue());
+            if (args[i] == "--sample-rate") options.sampleRate = juce::jmax(8000.0, value.getDoubleValue());
+            if (args[i] == "--preset-share") options.presetShare = juce::jlimit(0.0, 1.0, value.getDoubleValue());
+            if (args[i] == "--no-realtime") options.realtime = false;
+        }
+
+        return options;
+    }
+
+    double ticksToMicroseconds(juce::int64 ticks) {
+        return juce::Time::highResolutionTicksToSeconds(ticks) * 1000000.0;
+    }
+
+    // resident set size of the process in bytes, 0 where unknown
+    juce::int64 getResidentBytes() {
+       #if JUCE_LINUX
+        auto fields = juce::StringArray::fromTokens(juce::File("/proc/self/statm").loadFileAsString(), " ", "");
+        return fields[1].getLargeIntValue() * (juce::int64) sysconf(_SC_PAGESIZE);
+       #else
+        return 0;
+       #endif
+    }
+
+    // value at the given fraction (0..1) of sorted values
+    double percentile(const std::vector<double>& sortedValues, double fraction) {
+        if (sortedValues.empty()) {
+            return 0.0;
+        }
+
+        return sortedValues[(size_t) juce::roundToInt(fraction * (double) (sortedValues.size() - 1))];
+    }
+
+    double mean(const std::vector<double>& values) {
+        double sum = 0.0;
+
+        for (auto value : values) {
+            sum += value;
+        }
+
+        return values.empty() ? 0.0 : sum / (double) values.size();
+    }
+
+    // one processor with its own MIDI stream and automation
+    struct StressInstance {
+        StressInstance(int index, const Options& options)
+            : processor(std::make_unique<AppAudioProcessor>()),
+              audioBuffer(2, options.blockSize),
+              blockSize(options.blockSize),
+              random(index + 1) {
+
+            midiBuffer.ensureSize(1024);
+            processor->prepareToPlay(options.sampleRate, options.blockSize);
+
+            for (auto* parameter : processor->getParameters()) {
+                if (auto* ranged = dynamic_cast<juce::RangedAudioParameter*>(parameter)) {
+                    if (ranged->paramID.endsWith("Cents")) {
+                        tuningParameters.push_back(ranged);
+                    }
+                }
+            }
+        }
+
+        // the host side of a block: incoming MIDI and automation
+        void prepareBlock() {
+            midiBuffer.clear();
+
+            auto numEvents = random.nextInt(6);
+
+            for (int i = 0; i < numEvents; i++) {
+                auto samplePosition = random.nextInt(blockSize);
+
+                switch (random.nextInt(10)) {
+                    case 0: case 1: case 2: case 3:
+                        playingNote = 36 + random.nextInt(48);
+                        midiBuffer.addEvent(juce::MidiMessage::noteOn(1, playingNote, 0.8f), samplePosition);
+                        break;
+                    case 4: case 5:
+                        if (playingNote >= 0) {
+                            midiBuffer.addEvent(juce::MidiMessage::noteOff(1, playingNote), samplePosition);
+                        }
+                        break;
+                    case 6: case 7: case 8:
+                        midiBuffer.addEvent(juce::MidiMessage::pitchWheel(1, random.nextInt(16384)), samplePosition);
+                        break;
+                    default:
+                        midiBuffer.addEvent(juce::MidiMessage::controllerEvent(1, 64, random.nextBool() ? 127 : 0), samplePosition);
+                        break;
+                }
+            }
+
+            // roughly every eighth block, one of the tunings is automated
+            if (! tuningParameters.empty() && random.nextInt(8) == 0) {
+                tuningParameters[(size_t) random.nextInt((int) tuningParameters.size())]->setValueNotifyingHost(random.nextFloat());
+            }
+        }
+
+        std::unique_ptr<AppAudioProcessor> processor;
+        juce::AudioBuffer<float> audioBuffer;
+        juce::MidiBuffer midiBuffer;
+        int blockSize;
+        juce::Random random;
+        std::vector<juce::RangedAudioParameter*> tuningParameters;
+        int playingNote = -1;
+    };
+
+    // stands in for the message thread of a host, the only thread touching the settings (and the preset
+    // list) shared by all instances. Workers request preset operations, which it runs one after another
+    class PresetThread {
+    public:
+        explicit PresetThread(std::vector<std::unique_ptr<StressInstance>>& instancesToUse)
+            : instances(instancesToUse), thread([this] { run(); }) {
+        }
+
+        ~PresetThread() {
+            stop();
+        }
+
+        // called by the workers: queues a save, load or remove of a random preset through the given instance
+        void request(int instanceIndex) {
+            {
+                std::lock_guard<std::mutex> lock (requestLock);
+                requests.push_back({ instanceIndex, juce::Time::getHighResolutionTicks() });
+            }
+
+            requestAdded.notify_one();
+        }
+
+        // runs the requests still queued, then removes the presets left over (on the benchmark's own settings file)
+        void stop() {
+            if (! thread.joinable()) {
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock (requestLock);
+                quit = true;
+            }
+
+            requestAdded.notify_one();
+            thread.join();
+
+            for (; numPresets > 0; numPresets--) {
+                instances.front()->processor->removePresetInternal(0);
+            }
+
+            std::sort(queueDelaysUs.begin(), queueDelaysUs.end());
+            std::sort(operationTimesUs.begin(), operationTimesUs.end());
+        }
+
+        // sorted, valid after stop(): from a request until its operation started, and the operations themselves
+        std::vector<double> queueDelaysUs;
+        std::vector<double> operationTimesUs;
+
+    private:
+        struct Request {
+            int instanceIndex;
+            juce::int64 requestTicks;
+        };
+
+        void run() {
+            for (;;) {
+                Request request;
+
+                {
+                    std::unique_lock<std::mutex> lock (requestLock);
+                    requestAdded.wait(lock, [this] { return quit || ! requests.empty(); });
+
+                    if (requests.empty()) {
+                        return;
+                    }
+
+                    request = requests.front();
+                    requests.pop_front();
+                }
+
+                auto start = juce::Time::getHighResolutionTicks();
+                auto& processor = *instances[(size_t) request.instanceIndex]->processor;
+
+                switch (numPresets > 0 ? random.nextInt(3) : 0) {
+                    case 0:
+                        processor.savePresetInternal();
+                        numPresets++;
+                        break;
+                    case 1:
+                        processor.loadPresetInternal(random.nextInt(numPresets));
+                        break;
+                    default:
+                        processor.removePresetInternal(random.nextInt(numPresets));
+                        numPresets--;
+                        break;
+                }
+
+                auto end = juce::Time::getHighResolutionTicks();
+
+                queueDelaysUs.push_back(ticksToMicroseconds(start - request.requestTicks));
+                operationTimesUs.push_back(ticksToMicroseconds(end - start));
+            }
+        }
+
+        std::vector<std::unique_ptr<StressInstance>>& instances;
+        juce::Random random { 42 };
+        int numPresets = 0;
+
+        // guards the request queue only, never held while an operation runs
+        std::mutex requestLock;
+        std::condition_variable requestAdded;
+        std::deque<Request> requests;
+        bool quit = false;
+
+        std::thread thread;
+    };
+
+    struct PhaseResult {
+        std::vector<double> blockTimesUs;
+        std::vector<double> cycleTimesUs;
+        double wallSeconds = 0.0;
+        double cpuSeconds = 0.0;
+        int deadlineMisses = 0;
+    };
+
+    // processes all instances for the given time; each cycle, the workers take the next unprocessed
+    // instance until all are done, and the next cycle starts when every worker has finished.
+    // With a presetThread, that share of blocks is followed by a preset operation requested from it
+    PhaseResult runPhase(std::vector<std::unique_ptr<StressInstance>>& instances, int numThreads,
+                         double seconds, const Options& options,
+                         double presetShare = 0.0, PresetThread* presetThread = nullptr) {
+        const double cycleSeconds = options.blockSize / options.sampleRate;
+        const int numCycles = juce::jmax(1, (int) (seconds / cycleSeconds));
+        const int numInstances = (int) instances.size();
+
+        PhaseResult result;
+        result.cycleTimesUs.reserve((size_t) numCycles);
+
+        // every worker records into its own vector, so the measurement doesn't add contention
+        std::vector<std::vector<double>> threadBlockTimes ((size_t) numThreads);
+
+        for (auto& blockTimes : threadBlockTimes) {
+            blockTimes.reserve((size_t) numCycles * (size_t) numInstances);
+        }
+
+        std::atomic<int> nextInstance { 0 };
+        std::atomic<int> finishedWorkers { 0 };
+        std::atomic<bool> quit { false };
+
+        std::vector<std::unique_ptr<juce::WaitableEvent>> startEvents;
+        juce::WaitableEvent cycleDone;
+
+        for (int i = 0; i < numThreads; i++) {
+            startEvents.push_back(std::make_unique<juce::WaitableEvent>());
+        }
+
+        auto worker = [&](int threadIndex) {
+            auto& blockTimes = threadBlockTimes[(size_t) threadIndex];
+
+            for (;;) {
+                startEvents[(size_t) threadIndex]->wait();
+
+                if (quit) {
+                    return;
+                }
+
+                for (int i = nextInstance++; i < numInstances; i = nextInstance++) {
+                    auto& instance = *instances[(size_t) i];
+                    instance.prepareBlock();
+
+                    auto start = juce::Time::getHighResolutionTicks();
+                    instance.processor->processBlock(instance.audioBuffer, instance.midiBuffer);
+                    blockTimes.push_back(ticksToMicroseconds(juce::Time::getHighResolutionTicks() - start));
+
+                    if (presetThread != nullptr && instance.random.nextDouble() < presetShare) {
+                        presetThread->request(i);
+                    }
+                }
+
+                if (++finishedWorkers == numThreads) {
+                    cycleDone.signal();
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+
+        for (int i = 0; i < numThreads; i++) {
+            threads.emplace_back(worker, i);
+        }
+
+        const auto cpuStart = std::clock();
+        const auto wallStart = std::chrono::steady_clock::now();
+        auto deadline = wallStart;
+
+        for (int cycle = 0; cycle < numCycles; cycle++) {
+            nextInstance = 0;
+            finishedWorkers = 0;
+
+            auto start = juce::Time::getHighResolutionTicks();
+
+            for (auto& startEvent : startEvents) {
+                startEvent->signal();
+            }
+
+            cycleDone.wait();
+
+            auto cycleUs = ticksToMicroseconds(juce::Time::getHighResolutionTicks() - start);
+            result.cycleTimesUs.push_back(cycleUs);
+
+            if (cycleUs > cycleSeconds * 1000000.0) {
+                result.deadlineMisses++;
+            }
+
+            if (options.realtime) {
+                deadline += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(cycleSeconds));
+                std::this_thread::sleep_until(deadline);
+            }
+        }
+
+        result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+        result.cpuSeconds = (double) (std::clock() - cpuStart) / CLOCKS_PER_SEC;
+
+        quit = true;
+
+        for (auto& startEvent : startEvents) {
+            startEvent->signal();
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (auto& blockTimes : threadBlockTimes) {
+            result.blockTimesUs.insert(result.blockTimesUs.end(), blockTimes.begin(), blockTimes.end());
+        }
+
+        std::sort(result.blockTimesUs.begin(), result.blockTimesUs.end());
+        std::sort(result.cycleTimesUs.begin(), result.cycleTimesUs.end());
+
+        return result;
+    }
+
+    void printPhase(const char* name, const PhaseResult& result, int numThreads, const Options& options) {
+        const double cycleBudgetUs = options.blockSize / options.sampleRate * 1000000.0;
+        const double busySeconds = mean(result.blockTimesUs) * (double) result.blockTimesUs.size() / 1000000.0;
+
+        // std::clock is process CPU time on Linux and macOS, but wall time on Windows
+        std::printf("[%s]\n", name);
+        std::printf("  cpu: %.2f cores (process), workers busy %.1f%% of %d threads\n",
+                    result.cpuSeconds / result.wallSeconds, 100.0 * busySeconds / (result.wallSeconds * numThreads), numThreads);
+        std::printf("  block us: p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f  (%d blocks)\n",
+                    percentile(result.blockTimesUs, 0.5), percentile(result.blockTimesUs, 0.9),
+                    percentile(result.blockTimesUs, 0.99), percentile(result.blockTimesUs, 0.999),
+                    percentile(result.blockTimesUs, 1.0), (int) result.blockTimesUs.size());
+        std::printf("  cycle us: p50 %.1f  p99 %.1f  max %.1f  of %.1f budget, %d of %d cycles missed the deadline\n",
+                    percentile(result.cycleTimesUs, 0.5), percentile(result.cycleTimesUs, 0.99),
+                    percentile(result.cycleTimesUs, 1.0), cycleBudgetUs,
+                    result.deadlineMisses, (int) result.cycleTimesUs.size());
+    }
+
+    // compares the phase with preset traffic on the message thread stand-in to the same phase without it.
+    // Blocks getting slower point at preset operations reaching the audio path of the instances
+    void printPresetContention(const PhaseResult& idle, const PhaseResult& withPresets, const PresetThread& presetThread) {
+        const auto& queueDelays = presetThread.queueDelaysUs;
+        const auto& operationTimes = presetThread.operationTimesUs;
+
+        std::printf("[presets on the message thread stand-in]\n");
+        std::printf("  %d operations (save/load/remove), us: mean %.1f  p99 %.1f  max %.1f\n",
+                    (int) operationTimes.size(), mean(operationTimes),
+                    percentile(operationTimes, 0.99), percentile(operationTimes, 1.0));
+        std::printf("  queueing delay until an operation started, us: mean %.1f  p99 %.1f  max %.1f\n",
+                    mean(queueDelays), percentile(queueDelays, 0.99), percentile(queueDelays, 1.0));
+        std::printf("  with presets / without: block mean %.2f  block p99 %.2f  cycle p99 %.2f, deadline misses %d / %d\n",
+                    mean(withPresets.blockTimesUs) / juce::jmax(1.0e-9, mean(idle.blockTimesUs)),
+                    percentile(withPresets.blockTimesUs, 0.99) / juce::jmax(1.0e-9, percentile(idle.blockTimesUs, 0.99)),
+                    percentile(withPresets.cycleTimesUs, 0.99) / juce::jmax(1.0e-9, percentile(idle.cycleTimesUs, 0.99)),
+                    withPresets.deadlineMisses, idle.deadlineMisses);
+    }
+} // namespace
+
+int main(int argc, char* argv[]) {
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+
+    juce::StringArray args;
+
+    for (int i = 1; i < argc; i++) {
+        args.add(argv[i]);
+    }
+
+    const auto options = parseOptions(args);
+
+    std::printf("%d instances, %d threads, %d samples @ %.0f Hz, %.1f s%s\n",
+                options.numInstances, options.numThreads, options.blockSize, options.sampleRate,
+                options.seconds, options.realtime ? " (realtime)" : " (as fast as possible)");
+
+    // instances are created on the message thread, like a host does
+    std::vector<std::unique_ptr<StressInstance>> instances;
+    std::vector<double> constructionTimesUs;
+
+    const auto residentBefore = getResidentBytes();
+
+    for (int i = 0; i < options.numInstances; i++) {
+        auto start = juce::Time::getHighResolutionTicks();
+        instances.push_back(std::make_unique<StressInstance>(i, options));
+        constructionTimesUs.push_back(ticksToMicroseconds(juce::Time::getHighResolutionTicks() - start));
+    }
+
+    const auto residentAfter = getResidentBytes();
+
+    // the first and last tenth show whether creating an instance gets slower with the number of instances
+    const auto tenth = juce::jmax(1, options.numInstances / 10);
+    const std::vector<double> firstCreated (constructionTimesUs.begin(), constructionTimesUs.begin() + tenth);
+    const std::vector<double> lastCreated (constructionTimesUs.end() - tenth, constructionTimesUs.end());
+
+    std::printf("[instances]\n");
+
+    if (residentAfter > 0) {
+        std::printf("  memory: %.1f KiB per instance (resident)\n",
+                    (double) (residentAfter - residentBefore) / options.numInstances / 1024.0);
+    } else {
+        std::printf("  memory: not measured on this platform\n");
+    }
+
+    std::printf("  create us: mean %.1f  (first tenth %.1f, last tenth %.1f)\n",
+                mean(constructionTimesUs), mean(firstCreated), mean(lastCreated));
+
+    // single threaded reference, the same work spread over the pool should cost the same per block
+    auto reference = runPhase(instances, 1, juce::jmin(kReferenceSeconds, options.seconds), options);
+    printPhase("1 thread", reference, 1, options);
+
+    auto result = runPhase(instances, options.numThreads, options.seconds, options);
+    auto name = juce::String(options.numThreads) + " threads";
+    printPhase(name.toRawUTF8(), result, options.numThreads, options);
+
+    // anything well above 1 means the instances slow each other down (shared state, locks, caches)
+    std::printf("[contention]\n");
+    std::printf("  mean block time %d threads / 1 thread: %.2f\n",
+                options.numThreads, mean(result.blockTimesUs) / juce::jmax(1.0e-9, mean(reference.blockTimesUs)));
+
+    // the same parallel run, with workers requesting preset operations from the message thread stand-in
+    PresetThread presetThread (instances);
+
+    auto presetResult = runPhase(instances, options.numThreads, options.seconds, options, options.presetShare, &presetThread);
+    presetThread.stop();
+
+    auto presetName = name + ", presets";
+    printPhase(presetName.toRawUTF8(), presetResult, options.numThreads, options);
+    printPresetContention(result, presetResult, presetThread);
+
+    return 0;
+}
@@ -18,7 +18,10 @@
 #include "version.h"
 
 // current version of serialization
-#define APP_SERIALIZE_CURRENT_VERSION  1
+#define APP_SERIALIZE_CURRENT_VERSION  2
+
+// header of the binary plugin state ("MTst"), everything else is treated as legacy XML state
+#define APP_SERIALIZE_MAGIC  0x4d547374
 
 // used for properties file
 #define APP_APP_NAME "YOUR_APP_NAME"
@@ -0,0 +1,106 @@
+/***************************************************************
+ ** Copyright (C) 2021 Aron Homberg
+ **
+ ** You may also use this code under the terms of the
+ ** GPL v3 (see www.gnu.org/licenses).
+ ** MICROTUNE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL
+ ** WARRANTIES, WHETHER EXPRESSED OR IMPLIED, INCLUDING
+ ** MERCHANTABILITY AND FITNESS FOR PURPOSE, ARE DISCLAIMED.
+ ***************************************************************/
+
+#ifndef HELDNOTES_H_INCLUDED
+#define HELDNOTES_H_INCLUDED
+
+/* State of every MIDI note (off, held or sustained by the pedal) deciding which note owns the
+   global bend: the most recently pressed note that still sounds. Fixed size, never allocates. */
+class HeldNotes
+{
+public:
+    HeldNotes()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        states.fill (NoteState::off);
+        pressOrder.fill (0);
+        nextPressOrder = 1;
+        sustainDown = false;
+        bendOwner = -1;
+    }
+
+    void noteOn (int noteNumber)
+    {
+        states[(size_t) noteNumber] = NoteState::held;
+        pressOrder[(size_t) noteNumber] = nextPressOrder++;
+
+        // the latest note always takes over the bend
+        bendOwner = noteNumber;
+    }
+
+    void noteOff (int noteNumber)
+    {
+        if (states[(size_t) noteNumber] != NoteState::held) {
+            return;
+        }
+
+        states[(size_t) noteNumber] = sustainDown ? NoteState::sustained : NoteState::off;
+
+        if (noteNumber == bendOwner) {
+            updateBendOwner();
+        }
+    }
+
+    void setSustain (bool isDown)
+    {
+        sustainDown = isDown;
+
+        if (isDown) {
+            return;
+        }
+
+        for (auto& state : states) {
+            if (state == NoteState::sustained) {
+                state = NoteState::off;
+            }
+        }
+
+        updateBendOwner();
+    }
+
+    // the note whose tuning the bend carries, or -1 before the first note-on. Once every note has been
+    // released, the last owner is kept, so that release tails stay in tune
+    int getBendOwner() const
+    {
+        return bendOwner;
+    }
+
+private:
+    enum class NoteState : juce::uint8
+    {
+        off,
+        held,
+        sustained
+    };
+
+    void updateBendOwner()
+    {
+        juce::uint32 latestPressOrder = 0;
+
+        for (int noteNumber = 0; noteNumber < (int) states.size(); noteNumber++) {
+            if (states[(size_t) noteNumber] != NoteState::off && pressOrder[(size_t) noteNumber] > latestPressOrder) {
+                latestPressOrder = pressOrder[(size_t) noteNumber];
+                bendOwner = noteNumber;
+            }
+        }
+    }
+
+    std::array<NoteState, 128> states;
+    std::array<juce::uint32, 128> pressOrder;
+    juce::uint32 nextPressOrder;
+    bool sustainDown;
+    int bendOwner;
+};
+
+#endif  // HELDNOTES_H_INCLUDED
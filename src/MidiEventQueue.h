@@ -0,0 +1,142 @@
+/***************************************************************
+ ** Copyright (C) 2021 Aron Homberg
+ **
+ ** You may also use this code under the terms of the
+ ** GPL v3 (see www.gnu.org/licenses).
+ ** MICROTUNE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL
+ ** WARRANTIES, WHETHER EXPRESSED OR IMPLIED, INCLUDING
+ ** MERCHANTABILITY AND FITNESS FOR PURPOSE, ARE DISCLAIMED.
+ ***************************************************************/
+
+#ifndef MIDIEVENTQUEUE_H_INCLUDED
+#define MIDIEVENTQUEUE_H_INCLUDED
+
+/* Time-sorted queue of MIDI events of any length (including SysEx), scheduled in absolute sample time.
+   Memory is allocated in prepare() only, so push/pop are safe to call on the audio thread. */
+class MidiEventQueue
+{
+public:
+    // allocates room for the given number of events and bytes of message data, and drops everything queued
+    void prepare (int capacity, int dataCapacity)
+    {
+        events.clear();
+        events.reserve ((size_t) capacity);
+
+        data.assign ((size_t) dataCapacity, 0);
+        spareData.assign ((size_t) dataCapacity, 0);
+        dataSize = 0;
+    }
+
+    void clear()
+    {
+        events.clear();
+        dataSize = 0;
+    }
+
+    bool isEmpty() const
+    {
+        return events.empty();
+    }
+
+    bool isPrepared() const
+    {
+        return events.capacity() > 0;
+    }
+
+    // drops every event keep (data, size) returns false for, and reschedules the others to the given time
+    template <typename Predicate>
+    void keepOnly (Predicate&& keep, juce::int64 time)
+    {
+        events.erase (std::remove_if (events.begin(), events.end(), [&](const Event& event) {
+            return ! keep (data.data() + event.offset, event.size);
+        }), events.end());
+
+        for (auto& event : events) {
+            event.time = time;
+        }
+
+        compactData();
+    }
+
+    // inserts the message behind all events scheduled at the same time or earlier.
+    // Returns false if the queue is full, the message is dropped in that case
+    bool push (const juce::MidiMessage& message, juce::int64 time)
+    {
+        auto size = message.getRawDataSize();
+
+        if (events.size() == events.capacity() || dataSize + (size_t) size > data.size()) {
+            return false;
+        }
+
+        std::memcpy (data.data() + dataSize, message.getRawData(), (size_t) size);
+
+        Event event;
+        event.time = time;
+        event.offset = dataSize;
+        event.size = size;
+
+        dataSize += (size_t) size;
+
+        // events are mostly pushed in order, so searching from the back is cheap
+        auto position = events.end();
+
+        while (position != events.begin() && std::prev (position)->time > time) {
+            --position;
+        }
+
+        events.insert (position, event);
+
+        return true;
+    }
+
+    // removes all events scheduled before endTime, calling fn (data, size, time) for each in order
+    template <typename Fn>
+    void popUntil (juce::int64 endTime, Fn&& fn)
+    {
+        auto end = events.begin();
+
+        while (end != events.end() && end->time < endTime) {
+            fn (data.data() + end->offset, end->size, end->time);
+            ++end;
+        }
+
+        if (end == events.begin()) {
+            return;
+        }
+
+        events.erase (events.begin(), end);
+        compactData();
+    }
+
+private:
+    struct Event
+    {
+        juce::int64 time;
+        size_t offset;
+        int size;
+    };
+
+    // moves the data of the remaining events to the front, so that the free space is contiguous again
+    void compactData()
+    {
+        size_t spareSize = 0;
+
+        for (auto& event : events) {
+            std::memcpy (spareData.data() + spareSize, data.data() + event.offset, (size_t) event.size);
+            event.offset = spareSize;
+            spareSize += (size_t) event.size;
+        }
+
+        std::swap (data, spareData);
+        dataSize = spareSize;
+    }
+
+    std::vector<Event> events;
+
+    // message data of all queued events, and the buffer it is compacted into
+    std::vector<juce::uint8> data;
+    std::vector<juce::uint8> spareData;
+    size_t dataSize = 0;
+};
+
+#endif  // MIDIEVENTQUEUE_H_INCLUDED
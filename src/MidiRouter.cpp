@@ -0,0 +1,138 @@
+/***************************************************************
+ ** Copyright (C) 2021 Aron Homberg
+ **
+ ** You may also use this code under the terms of the
+ ** GPL v3 (see www.gnu.org/licenses).
+ ** MICROTUNE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL
+ ** WARRANTIES, WHETHER EXPRESSED OR IMPLIED, INCLUDING
+ ** MERCHANTABILITY AND FITNESS FOR PURPOSE, ARE DISCLAIMED.
+ ***************************************************************/
+
+#include "Constants.h"
+#include "PluginProcessor.h"
+#include "MidiRouter.h"
+
+namespace {
+    const char* const kInputPortName = "Microtune In";
+    const char* const kOutputPortName = "Microtune Out";
+
+    // a note-on results in two messages, so this is plenty for one incoming event
+    constexpr int kOutputBufferBytes = 256;
+
+    // any JUCE priority above 0 switches the thread to SCHED_RR on Linux (given rtprio permissions)
+    constexpr int kMidiThreadPriority = 9;
+
+    constexpr int kStatusRefreshMs = 500;
+} // namespace
+
+MidiRouter::MidiRouter(AppAudioProcessor& p, juce::Value statusValue)
+    : processor(p), status(statusValue)
+{
+    outputBuffer.ensureSize(kOutputBufferBytes);
+    status.setValue("MIDI thru: off");
+}
+
+MidiRouter::~MidiRouter()
+{
+    stop();
+}
+
+bool MidiRouter::start()
+{
+    if (isRunning()) {
+        return true;
+    }
+
+    output = juce::MidiOutput::createNewDevice(kOutputPortName);
+    input = juce::MidiInput::createNewDevice(kInputPortName, this);
+
+    if (input == nullptr || output == nullptr) {
+        input.reset();
+        output.reset();
+
+        status.setValue("MIDI thru: virtual MIDI ports are not supported on this platform");
+        return false;
+    }
+
+    resetProcessingStats();
+    threadPriorityRaised = false;
+    running = true;
+
+    input->start();
+    startTimer(kStatusRefreshMs);
+    timerCallback();
+
+    return true;
+}
+
+void MidiRouter::stop()
+{
+    if (! isRunning()) {
+        return;
+    }
+
+    stopTimer();
+
+    input->stop();
+    running = false;
+
+    input.reset();
+    output.reset();
+
+    status.setValue("MIDI thru: off");
+}
+
+void MidiRouter::handleIncomingMidiMessage(juce::MidiInput*, const juce::MidiMessage& message)
+{
+    auto receivedMs = juce::Time::getMillisecondCounterHiRes();
+
+    // JUCE runs one MIDI input thread for all input ports (the ALSA sequencer client on Linux), so this
+    // also makes the inputs of the audio device settings real-time. Their events are dropped while
+    // MIDI thru is running anyway
+    if (! threadPriorityRaised) {
+        juce::Thread::setCurrentThreadPriority(kMidiThreadPriority);
+        threadPriorityRaised = true;
+    }
+
+    processor.processMidiMessageNow(message, outputBuffer);
+
+    for (const auto metadata : outputBuffer) {
+        output->sendMessageNow(metadata.getMessage());
+    }
+
+    outputBuffer.clear();
+
+    // processing time of the router: from this callback receiving the event until its tuned messages
+    // have been sent. The message timestamp isn't any earlier (JUCE's input thread sets it right before
+    // the callback), and the round trip through the ports and the MIDI system isn't measured
+    auto processingMs = juce::Time::getMillisecondCounterHiRes() - receivedMs;
+
+    lastProcessingMs = processingMs;
+    totalProcessingMs = totalProcessingMs.load() + processingMs;
+    numEvents++;
+
+    if (processingMs > maxProcessingMs.load()) {
+        maxProcessingMs = processingMs;
+    }
+}
+
+void MidiRouter::timerCallback()
+{
+    auto count = numEvents.load();
+    auto meanProcessingMs = count > 0 ? totalProcessingMs.load() / count : 0.0;
+
+    status.setValue("MIDI thru: " + juce::String(kInputPortName) + " -> " + juce::String(kOutputPortName)
+                    + " (MIDI inputs of the audio settings are ignored)"
+                    + ", processing time (receipt to send): last " + juce::String(lastProcessingMs.load(), 3)
+                    + " ms, mean " + juce::String(meanProcessingMs, 3)
+                    + " ms, max " + juce::String(maxProcessingMs.load(), 3)
+                    + " ms (" + juce::String(count) + " events)");
+}
+
+void MidiRouter::resetProcessingStats()
+{
+    lastProcessingMs = 0.0;
+    maxProcessingMs = 0.0;
+    totalProcessingMs = 0.0;
+    numEvents = 0;
+}
@@ -0,0 +1,65 @@
+/***************************************************************
+ ** Copyright (C) 2021 Aron Homberg
+ **
+ ** You may also use this code under the terms of the
+ ** GPL v3 (see www.gnu.org/licenses).
+ ** MICROTUNE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL
+ ** WARRANTIES, WHETHER EXPRESSED OR IMPLIED, INCLUDING
+ ** MERCHANTABILITY AND FITNESS FOR PURPOSE, ARE DISCLAIMED.
+ ***************************************************************/
+
+#ifndef MIDIROUTER_H_INCLUDED
+#define MIDIROUTER_H_INCLUDED
+
+class AppAudioProcessor;
+
+/* Standalone MIDI-thru mode for live rigs.
+   Opens a virtual MIDI input and output port (ALSA sequencer on Linux, CoreMIDI on macOS) and tunes
+   every event on the MIDI input thread as soon as it arrives, instead of once per audio callback.
+   While it runs, MIDI from the inputs enabled in the audio settings is ignored. */
+class MidiRouter : private juce::MidiInputCallback,
+                   private juce::Timer
+{
+public:
+    // status receives a human readable state including the measured processing time
+    MidiRouter (AppAudioProcessor& processor, juce::Value status);
+    ~MidiRouter() override;
+
+    // returns false if virtual MIDI ports can't be created on this platform
+    bool start();
+    void stop();
+
+    bool isRunning() const
+    {
+        return running.load();
+    }
+
+private:
+    void handleIncomingMidiMessage (juce::MidiInput* source, const juce::MidiMessage& message) override;
+    void timerCallback() override;
+
+    void resetProcessingStats();
+
+    AppAudioProcessor& processor;
+    juce::Value status;
+
+    std::unique_ptr<juce::MidiInput> input;
+    std::unique_ptr<juce::MidiOutput> output;
+
+    // preallocated, holds the tuned messages of one incoming event
+    juce::MidiBuffer outputBuffer;
+
+    std::atomic<bool> running { false };
+    bool threadPriorityRaised = false;
+
+    // processing time from receiving an event to its tuned messages being sent, in milliseconds.
+    // Written on the MIDI thread only, read by the timer on the message thread
+    std::atomic<double> lastProcessingMs { 0.0 };
+    std::atomic<double> maxProcessingMs { 0.0 };
+    std::atomic<double> totalProcessingMs { 0.0 };
+    std::atomic<int> numEvents { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MidiRouter)
+};
+
+#endif  // MIDIROUTER_H_INCLUDED
@@ -0,0 +1,57 @@
+/***************************************************************
+ ** Copyright (C) 2021 Aron Homberg
+ **
+ ** You may also use this code under the terms of the
+ ** GPL v3 (see www.gnu.org/licenses).
+ ** MICROTUNE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL
+ ** WARRANTIES, WHETHER EXPRESSED OR IMPLIED, INCLUDING
+ ** MERCHANTABILITY AND FITNESS FOR PURPOSE, ARE DISCLAIMED.
+ ***************************************************************/
+
+#ifndef OUTPUTMODES_H_INCLUDED
+#define OUTPUTMODES_H_INCLUDED
+
+/* Compile-time policies of the event processing kernel (see AppAudioProcessor::processMidiEvent).
+   processBlock picks the matching specialisation once per block, so the per-event loop
+   has no mode checks and no virtual calls. The indices match the choices of the parameters. */
+
+namespace OutputModes
+{
+    // a bend after every note-on and every pitch wheel movement offset by the tuning, for all notes at once
+    struct GlobalBend
+    {
+        static constexpr int index = 0;
+        static constexpr bool tunes = true;
+    };
+
+    // every event is forwarded unchanged
+    struct PassThrough
+    {
+        static constexpr int index = 1;
+        static constexpr bool tunes = false;
+    };
+}
+
+namespace BendRanges
+{
+    // pitch wheel steps per cent, depending on the pitch bend range the synth is set to
+
+    // the scaling Microtune always used: 198 cents over the full wheel range (about +/-1 semitone)
+    struct OneSemitone
+    {
+        static constexpr int index = 0;
+        static constexpr float wheelValuePerCent = 16383 / 198;
+    };
+
+    template <int Semitones, int Index>
+    struct Symmetric
+    {
+        static constexpr int index = Index;
+        static constexpr float wheelValuePerCent = 8192.0f / (Semitones * 100);
+    };
+
+    using TwoSemitones = Symmetric<2, 1>;
+    using TwelveSemitones = Symmetric<12, 2>;
+}
+
+#endif  // OUTPUTMODES_H_INCLUDED
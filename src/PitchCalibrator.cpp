@@ -0,0 +1,402 @@
+/***************************************************************
+ ** Copyright (C) 2021 Aron Homberg
+ **
+ ** You may also use this code under the terms of the
+ ** GPL v3 (see www.gnu.org/licenses).
+ ** MICROTUNE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL
+ ** WARRANTIES, WHETHER EXPRESSED OR IMPLIED, INCLUDING
+ ** MERCHANTABILITY AND FITNESS FOR PURPOSE, ARE DISCLAIMED.
+ ***************************************************************/
+
+#include "Constants.h"
+#include "PitchCalibrator.h"
+
+namespace {
+    // YIN integration window and maximum lag in samples at the analysis rate.
+    // At 48 kHz this covers ~47 Hz (kMaxLag) up to ~2.4 kHz (kMinLag)
+    constexpr int kWindowSize = 1024;
+    constexpr int kMaxLag = 1024;
+    constexpr int kMinLag = 20;
+    constexpr int kFrameSize = kWindowSize + kMaxLag;
+    constexpr int kHopSize = 1024;
+
+    // higher sample rates are decimated, so that the analysis cost doesn't grow with the rate
+    constexpr double kMaxAnalysisSampleRate = 48000.0;
+
+    // anti-aliasing low-pass before decimating: cutoff relative to the analysis rate (below its Nyquist
+    // frequency by the transition band) and FIR order per decimation factor
+    constexpr double kDecimatorCutoff = 0.4;
+    constexpr int kDecimatorOrderPerFactor = 64;
+
+    constexpr float kYinThreshold = 0.12f;
+
+    // mean square below which a frame is treated as silence (about -50 dBFS)
+    constexpr float kMinSignalPower = 1.0e-5f;
+
+    // a note counts as measured once it is held this many frames without drifting more than kStableCents
+    constexpr int kStableFramesToMeasure = 8;
+    constexpr float kStableCents = 5.0f;
+
+    constexpr double kFifoSeconds = 1.0;
+    constexpr int kStatusRefreshMs = 200;
+
+    const char* const kPitchClassNames[] = { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
+
+    using SIMDFloat = juce::dsp::SIMDRegister<float>;
+
+    float dotProduct(const float* a, const float* b, int num) {
+        float sum = 0.0f;
+
+        for (int i = 0; i < num; i++) {
+            sum += a[i] * b[i];
+        }
+
+        return sum;
+    }
+
+    // sum of squares of a SIMD aligned array
+    float sumOfSquares(const float* data, int num) {
+        auto accumulator = SIMDFloat::expand(0.0f);
+        int i = 0;
+
+        for (; i + (int) SIMDFloat::size() <= num; i += (int) SIMDFloat::size()) {
+            auto value = SIMDFloat::fromRawArray(data + i);
+            accumulator += value * value;
+        }
+
+        auto sum = accumulator.sum();
+
+        for (; i < num; i++) {
+            sum += data[i] * data[i];
+        }
+
+        return sum;
+    }
+} // namespace
+
+PitchCalibrator::PitchCalibrator(juce::Value statusValue)
+    : juce::Thread("Microtune pitch calibration"), status(statusValue)
+{
+    for (int pitchClass = 0; pitchClass < 12; pitchClass++) {
+        measuredCents[pitchClass] = 0.0f;
+        measuredFlags[pitchClass] = false;
+    }
+
+    status.setValue("Calibration: off");
+}
+
+PitchCalibrator::~PitchCalibrator()
+{
+    onPitchClassMeasured = nullptr;
+    stop();
+}
+
+void PitchCalibrator::prepare(double newSampleRate)
+{
+    // a running calibration is restarted by the timer, on the message thread
+    sampleRate = newSampleRate;
+}
+
+void PitchCalibrator::allocate()
+{
+    const auto rate = sampleRate.load();
+
+    if (rate == allocatedSampleRate) {
+        return;
+    }
+
+    const juce::SpinLock::ScopedLockType lock (bufferLock);
+
+    decimation = juce::jmax(1, (int) std::ceil(rate / kMaxAnalysisSampleRate));
+    analysisSampleRate = rate / decimation;
+
+    const int fifoSize = juce::jmax(kHopSize * decimation * 4, (int) (rate * kFifoSeconds));
+
+    fifoBuffer.assign((size_t) fifoSize, 0.0f);
+    fifo.setTotalSize(fifoSize);
+    readBuffer.assign((size_t) (kHopSize * decimation), 0.0f);
+
+    decimatorKernel.clear();
+
+    if (decimation > 1) {
+        auto coefficients = juce::dsp::FilterDesign<float>::designFIRLowpassWindowMethod(
+            (float) (analysisSampleRate * kDecimatorCutoff), rate, (size_t) (kDecimatorOrderPerFactor * decimation),
+            juce::dsp::WindowingFunction<float>::blackmanHarris);
+
+        auto* raw = coefficients->getRawCoefficients();
+        decimatorKernel.assign(raw, raw + coefficients->getFilterOrder() + 1);
+        std::reverse(decimatorKernel.begin(), decimatorKernel.end());
+    }
+
+    decimatorInput.assign(decimatorKernel.size() + (size_t) (kHopSize * decimation), 0.0f);
+
+    frame.assign((size_t) kFrameSize, 0.0f);
+    differenceStorage.allocate((size_t) kWindowSize + SIMDFloat::size(), true);
+    difference = SIMDFloat::getNextSIMDAlignedPtr(differenceStorage.get());
+    yinBuffer.assign((size_t) kMaxLag, 1.0f);
+
+    allocatedSampleRate = rate;
+}
+
+int PitchCalibrator::getHopSize() const
+{
+    return kHopSize * decimation;
+}
+
+bool PitchCalibrator::start()
+{
+    if (isRunning()) {
+        return true;
+    }
+
+    if (sampleRate.load() <= 0.0) {
+        status.setValue("Calibration: waiting for the audio input to start");
+        return false;
+    }
+
+    // allocated only when calibration is used, not for every instance
+    allocate();
+
+    fifo.reset();
+    std::fill(frame.begin(), frame.end(), 0.0f);
+    std::fill(decimatorInput.begin(), decimatorInput.end(), 0.0f);
+
+    stableNote = -1;
+    stableFrames = 0;
+    stableCentsSum = 0.0f;
+    lastMeasuredPitchClass = -1;
+    receivingInput = false;
+
+    running = true;
+
+    startThread();
+    startTimer(kStatusRefreshMs);
+    timerCallback();
+
+    return true;
+}
+
+void PitchCalibrator::stop()
+{
+    if (! isRunning()) {
+        return;
+    }
+
+    running = false;
+    stopThread(1000);
+    stopTimer();
+
+    // hand over what has been measured up to now
+    timerCallback();
+
+    status.setValue("Calibration: off");
+}
+
+void PitchCalibrator::pushSamples(const juce::AudioBuffer<float>& buffer, int numInputChannels)
+{
+    const int numChannels = juce::jmin(numInputChannels, buffer.getNumChannels());
+
+    if (! isRunning() || numChannels <= 0) {
+        return;
+    }
+
+    receivingInput = true;
+
+    const juce::SpinLock::ScopedTryLockType lock (bufferLock);
+
+    if (! lock.isLocked()) {
+        return;
+    }
+
+    const int numSamples = juce::jmin(buffer.getNumSamples(), fifo.getFreeSpace());
+    const float gain = 1.0f / (float) numChannels;
+
+    int start1, size1, start2, size2;
+    fifo.prepareToWrite(numSamples, start1, size1, start2, size2);
+
+    // mono mix straight into the FIFO
+    auto mixInto = [&](int fifoStart, int size, int sourceStart) {
+        if (size <= 0) {
+            return;
+        }
+
+        auto* destination = fifoBuffer.data() + fifoStart;
+        juce::FloatVectorOperations::copyWithMultiply(destination, buffer.getReadPointer(0, sourceStart), gain, size);
+
+        for (int channel = 1; channel < numChannels; channel++) {
+            juce::FloatVectorOperations::addWithMultiply(destination, buffer.getReadPointer(channel, sourceStart), gain, size);
+        }
+    };
+
+    mixInto(start1, size1, 0);
+    mixInto(start2, size2, size1);
+
+    fifo.finishedWrite(size1 + size2);
+}
+
+void PitchCalibrator::run()
+{
+    const int samplesPerHop = getHopSize();
+
+    while (! threadShouldExit()) {
+
+        if (fifo.getNumReady() < samplesPerHop) {
+            wait(2);
+            continue;
+        }
+
+        int start1, size1, start2, size2;
+        fifo.prepareToRead(samplesPerHop, start1, size1, start2, size2);
+
+        std::copy_n(fifoBuffer.data() + start1, size1, readBuffer.data());
+        std::copy_n(fifoBuffer.data() + start2, size2, readBuffer.data() + size1);
+
+        fifo.finishedRead(size1 + size2);
+
+        // after a sample rate change, nothing is analysed until the timer has started over
+        if (sampleRate.load() != allocatedSampleRate) {
+            continue;
+        }
+
+        analyseHop(readBuffer.data());
+    }
+}
+
+float PitchCalibrator::analyseHop(const float* samples)
+{
+    // slide the frame by one hop and append the new samples at the analysis rate
+    std::copy(frame.begin() + kHopSize, frame.end(), frame.begin());
+    auto* tail = frame.data() + kFrameSize - kHopSize;
+
+    if (decimation == 1) {
+        std::copy_n(samples, kHopSize, tail);
+    } else {
+        // low-pass filtered, computed at the decimated positions only
+        const int numTaps = (int) decimatorKernel.size();
+        const int history = numTaps - 1;
+
+        std::copy_n(samples, kHopSize * decimation, decimatorInput.data() + history);
+
+        for (int i = 0; i < kHopSize; i++) {
+            tail[i] = dotProduct(decimatorInput.data() + i * decimation, decimatorKernel.data(), numTaps);
+        }
+
+        std::copy(decimatorInput.end() - history, decimatorInput.end(), decimatorInput.begin());
+    }
+
+    auto frequency = detectPitch();
+    trackPitch(frequency);
+
+    return frequency;
+}
+
+float PitchCalibrator::detectPitch()
+{
+    const float* x = frame.data();
+
+    juce::FloatVectorOperations::copy(difference, x, kWindowSize);
+
+    if (sumOfSquares(difference, kWindowSize) / kWindowSize < kMinSignalPower) {
+        return 0.0f;
+    }
+
+    // YIN: difference function d(tau) = sum (x[j] - x[j + tau])^2, vectorised as a subtraction
+    // followed by a sum of squares, then normalised by its cumulative mean
+    float runningSum = 0.0f;
+    yinBuffer[0] = 1.0f;
+
+    for (int tau = 1; tau < kMaxLag; tau++) {
+        juce::FloatVectorOperations::subtract(difference, x, x + tau, kWindowSize);
+
+        auto d = sumOfSquares(difference, kWindowSize);
+        runningSum += d;
+
+        yinBuffer[(size_t) tau] = runningSum > 0.0f ? d * (float) tau / runningSum : 1.0f;
+    }
+
+    // first dip below the threshold, followed down to its local minimum
+    int tau = kMinLag;
+
+    while (tau < kMaxLag - 1 && yinBuffer[(size_t) tau] >= kYinThreshold) {
+        tau++;
+    }
+
+    if (tau >= kMaxLag - 1) {
+        return 0.0f;
+    }
+
+    while (tau + 1 < kMaxLag - 1 && yinBuffer[(size_t) tau + 1] < yinBuffer[(size_t) tau]) {
+        tau++;
+    }
+
+    // parabolic interpolation for sub-sample precision
+    auto s0 = yinBuffer[(size_t) tau - 1];
+    auto s1 = yinBuffer[(size_t) tau];
+    auto s2 = yinBuffer[(size_t) tau + 1];
+    auto denominator = s0 + s2 - 2.0f * s1;
+    auto shift = std::abs(denominator) > 1.0e-9f ? 0.5f * (s0 - s2) / denominator : 0.0f;
+
+    return (float) (analysisSampleRate / ((double) tau + shift));
+}
+
+void PitchCalibrator::trackPitch(float frequency)
+{
+    if (frequency <= 0.0f) {
+        stableNote = -1;
+        stableFrames = 0;
+        stableCentsSum = 0.0f;
+        return;
+    }
+
+    // deviation from the nearest equal tempered note (A4 = 440 Hz)
+    auto note = 69.0f + 12.0f * std::log2(frequency / 440.0f);
+    auto nearestNote = juce::roundToInt(note);
+    auto cents = (note - (float) nearestNote) * 100.0f;
+
+    if (nearestNote != stableNote
+        || (stableFrames > 0 && std::abs(cents - stableCentsSum / (float) stableFrames) > kStableCents)) {
+        stableNote = nearestNote;
+        stableFrames = 0;
+        stableCentsSum = 0.0f;
+    }
+
+    stableFrames++;
+    stableCentsSum += cents;
+
+    // measured once per held note
+    if (stableFrames == kStableFramesToMeasure) {
+        auto pitchClass = ((nearestNote % 12) + 12) % 12;
+
+        measuredCents[pitchClass] = stableCentsSum / (float) stableFrames;
+        measuredFlags[pitchClass] = true;
+        lastMeasuredPitchClass = pitchClass;
+    }
+}
+
+void PitchCalibrator::timerCallback()
+{
+    for (int pitchClass = 0; pitchClass < 12; pitchClass++) {
+        if (measuredFlags[pitchClass].exchange(false) && onPitchClassMeasured) {
+            onPitchClassMeasured(pitchClass, measuredCents[pitchClass].load());
+        }
+    }
+
+    // the sample rate changed while running: starting over with buffers for the new rate
+    if (isRunning() && sampleRate.load() != allocatedSampleRate) {
+        stop();
+        start();
+        return;
+    }
+
+    auto lastPitchClass = lastMeasuredPitchClass.load();
+
+    if (lastPitchClass < 0) {
+        // without any input channels, pushSamples never gets anything to analyse
+        status.setValue(receivingInput ? "Calibration: play and hold single notes"
+                                       : "Calibration: no audio input, enable the calibration input (in the host or the audio settings)");
+        return;
+    }
+
+    status.setValue("Calibration: " + juce::String(kPitchClassNames[lastPitchClass]) + " measured at "
+                    + juce::String(measuredCents[lastPitchClass].load(), 1) + " cents");
+}
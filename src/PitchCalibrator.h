@@ -0,0 +1,111 @@
+/***************************************************************
+ ** Copyright (C) 2021 Aron Homberg
+ **
+ ** You may also use this code under the terms of the
+ ** GPL v3 (see www.gnu.org/licenses).
+ ** MICROTUNE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY, AND ALL
+ ** WARRANTIES, WHETHER EXPRESSED OR IMPLIED, INCLUDING
+ ** MERCHANTABILITY AND FITNESS FOR PURPOSE, ARE DISCLAIMED.
+ ***************************************************************/
+
+#ifndef PITCHCALIBRATOR_H_INCLUDED
+#define PITCHCALIBRATOR_H_INCLUDED
+
+/* Calibration mode: tracks the pitch of the audio input (YIN) and reports the deviation
+   in cents of every pitch class that is held steadily, so that the tuning can follow a real instrument.
+   The audio thread only copies samples into a FIFO, the analysis runs on a thread of its own. */
+class PitchCalibrator : private juce::Thread,
+                        private juce::Timer
+{
+public:
+    // status receives a human readable state including the last measurement
+    explicit PitchCalibrator (juce::Value status);
+    ~PitchCalibrator() override;
+
+    // sets the sample rate of the input, call from prepareToPlay (any thread). Doesn't allocate, buffers
+    // are only allocated once calibration is started. A running calibration starts over at the new rate
+    void prepare (double sampleRate);
+
+    // message thread only. Returns false if prepare() hasn't been called yet
+    bool start();
+    void stop();
+
+    bool isRunning() const
+    {
+        return running.load();
+    }
+
+    // audio thread: mixes the first numInputChannels of buffer into the analysis FIFO.
+    // Never blocks or allocates, samples that don't fit are dropped
+    void pushSamples (const juce::AudioBuffer<float>& buffer, int numInputChannels);
+
+    // called on the message thread with the pitch class (0 = C) and its measured deviation in cents
+    std::function<void(int pitchClass, float cents)> onPitchClassMeasured;
+
+private:
+    // audioapp_bench drives the analysis directly
+    friend struct BenchmarkAccess;
+
+    // allocates the buffers for the prepared sample rate, if they aren't yet. Message thread only
+    void allocate();
+
+    // number of input samples per pitch estimate at the prepared sample rate
+    int getHopSize() const;
+
+    // low-pass filters and decimates one hop of input samples into the analysis frame, detects its pitch
+    // and tracks it. Returns the fundamental frequency in Hz, or 0 if there is no clear pitch
+    float analyseHop (const float* samples);
+
+    void run() override;
+    void timerCallback() override;
+
+    // returns the fundamental frequency of the current frame in Hz, or 0 if there is no clear pitch
+    float detectPitch();
+
+    // feeds one detected frequency into the per-note stability tracking
+    void trackPitch (float frequency);
+
+    juce::Value status;
+
+    // sample rate set by prepare(), and the one the buffers are allocated for
+    std::atomic<double> sampleRate { 0.0 };
+    double allocatedSampleRate = 0.0;
+    double analysisSampleRate = 0.0;
+    int decimation = 1;
+
+    // input FIFO, written by the audio thread and read by the analysis thread.
+    // The audio thread skips its samples while allocate() holds bufferLock
+    juce::SpinLock bufferLock;
+    juce::AbstractFifo fifo { 1 };
+    std::vector<float> fifoBuffer;
+    std::vector<float> readBuffer;
+
+    // anti-aliasing FIR low-pass applied before decimating (coefficients reversed),
+    // and its input: the last (taps - 1) samples of the previous hop followed by the current hop
+    std::vector<float> decimatorKernel;
+    std::vector<float> decimatorInput;
+
+    // analysis frame (integration window plus maximum lag) and the YIN scratch buffers
+    std::vector<float> frame;
+    juce::HeapBlock<float> differenceStorage;
+    float* difference = nullptr;       // SIMD aligned view into differenceStorage
+    std::vector<float> yinBuffer;
+
+    int stableNote = -1;
+    int stableFrames = 0;
+    float stableCentsSum = 0.0f;
+
+    // measurements handed from the analysis thread to the message thread
+    std::atomic<float> measuredCents[12];
+    std::atomic<bool> measuredFlags[12];
+    std::atomic<int> lastMeasuredPitchClass { -1 };
+
+    std::atomic<bool> running { false };
+
+    // whether the audio thread has handed over any input since the start (the input bus may be disabled)
+    std::atomic<bool> receivingInput { false };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PitchCalibrator)
+};
+
+#endif  // PITCHCALIBRATOR_H_INCLUDED
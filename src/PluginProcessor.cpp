@@ -15,15 +15,6 @@
 #include "BinaryData.h"
 #include "PresetListBox.h"
 
-const std::string WHITESPACE = " \n\r\t\f\v";
-
-// trim from end (in place)
-std::string rtrim(const std::string &s)
-{
-    size_t end = s.find_last_not_of(WHITESPACE);
-    return (end == std::string::npos) ? "" : s.substr(0, end + 1);
-}
-
 namespace ParamIDs
 {
     static juce::String cCents  { "cCents" };
@@ -38,30 +29,68 @@ namespace ParamIDs
     static juce::String aCents    { "aCents" };
     static juce::String aSharpCents    { "aSharpCents" };
     static juce::String bCents    { "bCents" };
+    static juce::String lookahead    { "lookahead" };
+    static juce::String lookaheadSamples    { "lookaheadSamples" };
+    static juce::String outputMode    { "outputMode" };
+    static juce::String bendRange    { "bendRange" };
 }
 
-namespace ToneNames
-{
-    static juce::String toneC  { "C" };
-    static juce::String toneCSharp    { "C#" };
-    static juce::String toneD    { "D" };
-    static juce::String toneDSharp    { "D#" };
-    static juce::String toneE    { "E" };
-    static juce::String toneF    { "F" };
-    static juce::String toneFSharp    { "F#" };
-    static juce::String toneG    { "G" };
-    static juce::String toneGSharp    { "G#" };
-    static juce::String toneA    { "A" };
-    static juce::String toneASharp    { "A#" };
-    static juce::String toneB    { "B" };
-}
+namespace {
+    // order of the tuning table in the serialized state, starting at C
+    const juce::String* const kToneParamIDs[] = {
+        &ParamIDs::cCents, &ParamIDs::cSharpCents, &ParamIDs::dCents, &ParamIDs::dSharpCents,
+        &ParamIDs::eCents, &ParamIDs::fCents, &ParamIDs::fSharpCents, &ParamIDs::gCents,
+        &ParamIDs::gSharpCents, &ParamIDs::aCents, &ParamIDs::aSharpCents, &ParamIDs::bCents
+    };
+
+    // GUI properties that describe what's going on right now, so they aren't saved with the state
+    const char* const kTransientProperties[] = { "midiThruStatus", "calibrationStatus" };
+
+    // copies the properties and children of source into destination, keeping everything else
+    void mergeProperties(juce::ValueTree destination, const juce::ValueTree& source) {
+        for (int i = 0; i < source.getNumProperties(); i++) {
+            auto name = source.getPropertyName(i);
+            destination.setProperty(name, source.getProperty(name), nullptr);
+        }
+
+        for (const auto& child : source) {
+            mergeProperties(destination.getOrCreateChildWithName(child.getType(), nullptr), child);
+        }
+    }
+} // namespace
 
 namespace {
     constexpr int kWheelMiddlePosValue = 8192;
     constexpr int kWheelMaxValue = 16383;
-    // max value divided by 198 cents because 200 cents make +/-2 semitones as by the MIDI spec,
-    // but we're dealing with 0 indexed numbers (-1) and 0 itself is a zero-multiplier (-2)
-    constexpr float kWheelValuePerCent = kWheelMaxValue / 198;
+
+    // lookahead mode: how long before its note-on a bend is sent, and how many events (and bytes of
+    // message data, SysEx included) can be delayed at once
+    constexpr double kLookaheadGuardSeconds = 0.001;
+    constexpr int kLookaheadQueueCapacity = 4096;
+    constexpr int kLookaheadQueueDataBytes = 65536;
+
+    // calls fn (OutputMode{}, BendRange{}) with the policies selected by the parameter indices,
+    // so that the kernel is chosen once per block instead of per event
+    template <typename Fn>
+    void dispatchKernel(int outputMode, int bendRange, Fn&& fn) {
+        if (outputMode == OutputModes::PassThrough::index) {
+            // the bend range doesn't matter when nothing is tuned
+            fn(OutputModes::PassThrough{}, BendRanges::OneSemitone{});
+            return;
+        }
+
+        switch (bendRange) {
+            case BendRanges::TwoSemitones::index:
+                fn(OutputModes::GlobalBend{}, BendRanges::TwoSemitones{});
+                break;
+            case BendRanges::TwelveSemitones::index:
+                fn(OutputModes::GlobalBend{}, BendRanges::TwelveSemitones{});
+                break;
+            default:
+                fn(OutputModes::GlobalBend{}, BendRanges::OneSemitone{});
+                break;
+        }
+    }
 } // namespace
 
 
@@ -95,39 +124,23 @@ juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout()
     createPitchParameterForTone(ParamIDs::aSharpCents, "A# Tone cents", layout);
     createPitchParameterForTone(ParamIDs::bCents, "B Tone cents", layout);
 
-    return layout;
-}
-
-NoteMetadata AppAudioProcessor::getNoteMetadata(int midiNoteNumber) {
-
-    NoteMetadata noteMetadata;
+    // lookahead mode, delays the MIDI stream so that bends can be sent ahead of their note-ons
+    layout.add(std::make_unique<juce::AudioParameterBool> (ParamIDs::lookahead, "Lookahead", false));
+    layout.add(std::make_unique<juce::AudioParameterInt> (ParamIDs::lookaheadSamples, "Lookahead samples", 0, 4096, 256));
 
-    // raster: 2 chars per note name "C ", "C#", "D ", ...
-    std::string notes = "C C#D D#E F F#G G#A A#B ";
+    // how the tuning is sent, and the pitch bend range the receiving synth is set to (see OutputModes.h)
+    layout.add(std::make_unique<juce::AudioParameterChoice> (ParamIDs::outputMode, "Output mode",
+                                                             juce::StringArray { "Global bend", "Pass-through" }, 0));
+    layout.add(std::make_unique<juce::AudioParameterChoice> (ParamIDs::bendRange, "Pitch bend range",
+                                                             juce::StringArray { "+/-1 semitone", "+/-2 semitones", "+/-12 semitones" }, 0));
 
-    // calculating the relative position inside an octave (e.g. 63 (MIDI note number) % 12 (tones) is 3
-    // having the distance from left (3 chars) is nice, but because every note name has 2 places like "C ",
-    // the index needs to be multiplied by 2. So rel. position for substr, which cuts a subset of a string,
-    // points to 6 for the MIDI note number 63. This actually points to the start pos of D# in the "notes" string.
-    // From there on, substr cuts the 2 places out. "D#" or "E " e.g. is now passed to rtim which cuts away
-    // whitespaces from the right, leaving us with "D#" and "E", the correctly
-    // formatted note name for a given MIDI note number.
-    noteMetadata.noteName = rtrim(notes.substr((midiNoteNumber % 12) * 2, 2));
-
-    // every octave has 12 tones, if we split the available 127 notes (0 to 127 noteNumber MIDI standard)
-    // into bunches of 12 notes (e.g. 127 / 12) we end up with the count of availanble octaves in the MIDI standard.
-    // here, we do it relatively, to find the octave, the specific key pressed, is in, shifted by 1 octave (-1) down
-    // because of modulo. The int cast makes sure, no decimal places are left over.
-    noteMetadata.octave = (int) midiNoteNumber / 12 - 1;
-    noteMetadata.noteNumber = midiNoteNumber;
-    noteMetadata.isDefined = true;
-
-    return noteMetadata;
+    return layout;
 }
 
 AppAudioProcessor::AppAudioProcessor() :
 #ifndef JucePlugin_PreferredChannelConfigurations
-   MagicProcessor(BusesProperties().withOutput("Output", AudioChannelSet::stereo(), true)),
+   MagicProcessor(BusesProperties().withInput("Calibration input", AudioChannelSet::stereo(), false)
+                                   .withOutput("Output", AudioChannelSet::stereo(), true)),
 #endif
    treeState (*this, nullptr, JucePlugin_Name, createParameterLayout())
 {
@@ -139,18 +152,17 @@ AppAudioProcessor::AppAudioProcessor() :
             treeState.addParameterListener (p->paramID, this);
 
     // setting all cent tuning values initially
-    cCents = treeState.getRawParameterValue ("cCents")->load();
-    cSharpCents = treeState.getRawParameterValue ("cSharpCents")->load();
-    dCents = treeState.getRawParameterValue ("dCents")->load();
-    dSharpCents = treeState.getRawParameterValue ("dSharpCents")->load();
-    eCents = treeState.getRawParameterValue ("eCents")->load();
-    fCents = treeState.getRawParameterValue ("fCents")->load();
-    fSharpCents = treeState.getRawParameterValue ("fSharpCents")->load();
-    gCents = treeState.getRawParameterValue ("gCents")->load();
-    gSharpCents = treeState.getRawParameterValue ("gSharpCents")->load();
-    aCents = treeState.getRawParameterValue ("aCents")->load();
-    aSharpCents = treeState.getRawParameterValue ("aSharpCents")->load();
-    bCents = treeState.getRawParameterValue ("bCents")->load();
+    for (int i = 0; i < numElementsInArray (kToneParamIDs); i++)
+        tuningTable[i] = treeState.getRawParameterValue (*kToneParamIDs[i])->load();
+
+    lookaheadEnabled = treeState.getRawParameterValue ("lookahead")->load() >= 0.5f;
+    lookaheadSamples = (int) treeState.getRawParameterValue ("lookaheadSamples")->load();
+
+    outputMode = (int) treeState.getRawParameterValue ("outputMode")->load();
+    bendRange = (int) treeState.getRawParameterValue ("bendRange")->load();
+    trackedOutputMode = outputMode;
+
+    inputPitchWheelValue = kWheelMiddlePosValue;
 
     // preset handling
     presetList = magicState.createAndAddObject<PresetListBox>("presets");
@@ -172,6 +184,42 @@ AppAudioProcessor::AppAudioProcessor() :
         removePresetInternal(currentPresetIndexSelected);
     });
 
+    // standalone MIDI-thru mode, tuning on a dedicated MIDI thread instead of the audio callback
+    if (wrapperType == wrapperType_Standalone) {
+        midiRouter = std::make_unique<MidiRouter>(*this, magicState.getPropertyAsValue(":midiThruStatus"));
+    }
+
+    // calibration mode, writes the measured deviation of every pitch class into its cent parameter
+    pitchCalibrator = std::make_unique<PitchCalibrator>(magicState.getPropertyAsValue(":calibrationStatus"));
+
+    pitchCalibrator->onPitchClassMeasured = [this](int pitchClass, float cents)
+    {
+        setParameterPlainValue(*kToneParamIDs[pitchClass], cents);
+    };
+
+    magicState.addTrigger ("toggle-calibration", [this]
+    {
+        if (pitchCalibrator->isRunning()) {
+            pitchCalibrator->stop();
+        } else {
+            pitchCalibrator->start();
+        }
+    });
+
+    magicState.addTrigger ("toggle-midi-thru", [this]
+    {
+        if (midiRouter == nullptr) {
+            magicState.getPropertyAsValue(":midiThruStatus").setValue("MIDI thru is only available in the standalone app");
+            return;
+        }
+
+        if (midiRouter->isRunning()) {
+            midiRouter->stop();
+        } else {
+            midiRouter->start();
+        }
+    });
+
     magicState.setApplicationSettingsFile (juce::File::getSpecialLocation (juce::File::userApplicationDataDirectory)
                                                .getChildFile (ProjectInfo::companyName)
                                                .getChildFile (ProjectInfo::projectName + juce::String (".settings")));
@@ -219,6 +267,10 @@ void AppAudioProcessor::loadPresetInternal(int index)
 
 AppAudioProcessor::~AppAudioProcessor()
 {
+    // the router calls back into this processor from its MIDI thread
+    midiRouter.reset();
+    pitchCalibrator.reset();
+
     for (auto* parameter : getParameters())
         if (auto* p = dynamic_cast<juce::AudioProcessorParameterWithID*>(parameter))
             treeState.removeParameterListener (p->paramID, this);
@@ -253,10 +305,133 @@ void AppAudioProcessor::changeProgramName (int , const String& )
 {
 }
 
-void AppAudioProcessor::prepareToPlay (double , int )
+void AppAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
 {
-    // Use this method as the place to do any pre-playback
-    // initialisation that you need
+    // compact binary state: a header with magic number and version, followed by the plain values.
+    // This is much faster to write and read than the XML representation of the whole treeState,
+    // which matters when a project holds many instances.
+    juce::MemoryOutputStream stream (destData, false);
+
+    stream.writeInt (APP_SERIALIZE_MAGIC);
+    stream.writeInt (APP_SERIALIZE_CURRENT_VERSION);
+
+    // active tuning table
+    stream.writeInt (numElementsInArray (tuningTable));
+
+    for (auto cents : tuningTable)
+        stream.writeFloat (cents);
+
+    // preset reference, by name: indices change whenever any instance adds or removes a preset
+    stream.writeString (magicState.getPropertyAsValue (":presetName").getValue().toString());
+
+    // mode settings
+    stream.writeBool (lookaheadEnabled);
+    stream.writeInt (lookaheadSamples);
+    stream.writeInt (outputMode);
+    stream.writeInt (bendRange);
+
+    // GUI properties
+    auto properties = magicState.getPropertyRoot().createCopy();
+
+    for (auto* name : kTransientProperties)
+        properties.removeProperty (name, nullptr);
+
+    properties.writeToStream (stream);
+}
+
+void AppAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
+{
+    juce::MemoryInputStream stream (data, (size_t) sizeInBytes, false);
+
+    // projects saved before the binary format existed contain the XML state of the MagicProcessor
+    if (sizeInBytes < 8 || stream.readInt() != APP_SERIALIZE_MAGIC)
+    {
+        MagicProcessor::setStateInformation (data, sizeInBytes);
+        return;
+    }
+
+    auto version = stream.readInt();
+
+    // version 2 is the first binary format. Newer versions shall only append fields,
+    // so we read as much as we know about
+    if (version < 2)
+    {
+        jassertfalse;
+        return;
+    }
+
+    // restored like AudioProcessorValueTreeState::replaceState does, so that the tree state,
+    // the GUI and the cached values all follow
+    auto numTones = stream.readInt();
+
+    for (int i = 0; i < numTones && ! stream.isExhausted(); i++)
+    {
+        auto cents = stream.readFloat();
+
+        if (i < numElementsInArray (kToneParamIDs))
+            setParameterPlainValue (*kToneParamIDs[i], cents);
+    }
+
+    auto presetName = stream.readString();
+
+    setParameterPlainValue (ParamIDs::lookahead, stream.readBool() ? 1.0f : 0.0f);
+    setParameterPlainValue (ParamIDs::lookaheadSamples, (float) stream.readInt());
+    setParameterPlainValue (ParamIDs::outputMode, (float) stream.readInt());
+    setParameterPlainValue (ParamIDs::bendRange, (float) stream.readInt());
+
+    auto properties = juce::ValueTree::readFromStream (stream);
+
+    if (properties.isValid())
+        mergeProperties (magicState.getPropertyRoot(), properties);
+
+    magicState.getPropertyAsValue (":presetName").setValue (presetName);
+    currentPresetIndexSelected = findPresetIndex (presetName);
+}
+
+void AppAudioProcessor::setParameterPlainValue(const juce::String& paramId, float plainValue)
+{
+    if (auto* parameter = treeState.getParameter (paramId))
+        parameter->setValueNotifyingHost (parameter->convertTo0to1 (plainValue));
+}
+
+int AppAudioProcessor::findPresetIndex(const juce::String& name)
+{
+    auto presets = magicState.getSettings().getChildWithName ("presets");
+
+    for (int i = 0; i < presets.getNumChildren(); i++)
+        if (name.isNotEmpty() && presets.getChild (i).getProperty ("name").toString() == name)
+            return i;
+
+    return -1;
+}
+
+void AppAudioProcessor::prepareToPlay (double sampleRate, int )
+{
+    // the lookahead queue is allocated here only, so that processBlock never allocates
+    if (! lookaheadQueue.isPrepared())
+        lookaheadQueue.prepare (kLookaheadQueueCapacity, kLookaheadQueueDataBytes);
+
+    lookaheadSampleTime = 0;
+    lastQueuedTime = 0;
+    lastQueuedBendTime = 0;
+    lookaheadGuardSamples = juce::roundToInt (sampleRate * kLookaheadGuardSeconds);
+
+    reportedLatencySamples = lookaheadEnabled ? lookaheadSamples : 0;
+    setLatencySamples (reportedLatencySamples);
+
+    {
+        // the MIDI router may be tuning on its thread meanwhile
+        const juce::SpinLock::ScopedLockType lock (midiProcessingLock);
+
+        heldNotes.reset();
+        inputPitchWheelValue = kWheelMiddlePosValue;
+        sentPitchWheelValue = -1;
+
+        // the sample time starts over, so pending note-offs are due right away
+        keepPendingNoteOffs (0);
+    }
+
+    pitchCalibrator->prepare (sampleRate);
 }
 
 void AppAudioProcessor::releaseResources()
@@ -265,6 +440,30 @@ void AppAudioProcessor::releaseResources()
     // spare memory, etc.
 }
 
+void AppAudioProcessor::reset()
+{
+    const juce::SpinLock::ScopedLockType lock (midiProcessingLock);
+
+    // transport stopped or jumped: no note sounds any more
+    heldNotes.reset();
+    sentPitchWheelValue = -1;
+    keepPendingNoteOffs (lookaheadSampleTime);
+}
+
+void AppAudioProcessor::keepPendingNoteOffs (juce::int64 time)
+{
+    // queued note-ons and bends are obsolete, but note-offs (and releases) of notes that were already sent
+    // must still go out, or those notes would hang
+    lookaheadQueue.keepOnly ([](const juce::uint8* data, int size) {
+        if (size > 3)
+            return false;
+
+        juce::MidiMessage message (data, size);
+
+        return message.isNoteOff() || message.isSustainPedalOff() || message.isAllNotesOff() || message.isAllSoundOff();
+    }, time);
+}
+
 #ifndef JucePlugin_PreferredChannelConfigurations
 bool AppAudioProcessor::isBusesLayoutSupported(const BusesLayout& layouts) const
 {
@@ -280,7 +479,9 @@ bool AppAudioProcessor::isBusesLayoutSupported(const BusesLayout& layouts) const
 
     // This checks if the input layout matches the output layout
    #if ! JucePlugin_IsSynth
-    if (layouts.getMainOutputChannelSet() != layouts.getMainInputChannelSet())
+    // the input is optional, it's only used for calibration
+    if (! layouts.getMainInputChannelSet().isDisabled()
+     && layouts.getMainOutputChannelSet() != layouts.getMainInputChannelSet())
         return false;
    #endif
 
@@ -289,212 +490,331 @@ bool AppAudioProcessor::isBusesLayoutSupported(const BusesLayout& layouts) const
 }
 #endif
 
-int AppAudioProcessor::calculatePitchWheelValue(NoteMetadata& noteMetadata, int currentPitchWheelValue) {
+template <typename BendRange>
+int AppAudioProcessor::calculatePitchWheelValue(int noteNumber, int currentPitchWheelValue) const {
 
-    float toneValue;
+    auto nextWheelValue = (float) currentPitchWheelValue + (tuningTable[noteNumber % 12] * BendRange::wheelValuePerCent);
 
-    if (noteMetadata.noteName == ToneNames::toneC) {
-        toneValue = cCents;
-    }
+    // hard limiting windowing for lower margin >= 0 upper margin <= 0x400
+    if (nextWheelValue < 0) return 0;
+    if (nextWheelValue >= 0x4000) return kWheelMaxValue;
 
-    if (noteMetadata.noteName == ToneNames::toneCSharp) {
-        toneValue = cSharpCents;
-    }
+    return (int) nextWheelValue;
+}
 
-    if (noteMetadata.noteName == ToneNames::toneD) {
-        toneValue = dCents;
+template <typename OutputMode, typename BendRange, typename Emit>
+void AppAudioProcessor::processMidiEvent(const juce::MidiMessage& midiMessage, int samplePosition, int guardSamples, Emit&& emit)
+{
+    // resolved at compile time, there's no mode check left in the specialisations
+    if (! OutputMode::tunes) {
+        emit(midiMessage, samplePosition, 0);
+        return;
     }
 
-    if (noteMetadata.noteName == ToneNames::toneDSharp) {
-        toneValue = dSharpCents;
-    }
+    // sends the bend of the note that owns it, but only if that changes what the synth already has
+    auto updateBend = [&](int advanceSamples) {
+        auto bendOwner = heldNotes.getBendOwner();
+        auto wheelValue = bendOwner < 0
+            ? inputPitchWheelValue
+            // every pitch wheel movement must add the microtuning difference to be relatively correct
+            : calculatePitchWheelValue<BendRange>(bendOwner, inputPitchWheelValue);
 
-    if (noteMetadata.noteName == ToneNames::toneE) {
-        toneValue = eCents;
-    }
+        if (wheelValue == sentPitchWheelValue) {
+            return;
+        }
 
-    if (noteMetadata.noteName == ToneNames::toneF) {
-        toneValue = fCents;
-    }
+        sentPitchWheelValue = wheelValue;
+
+        auto pitchMessage = juce::MidiMessage::pitchWheel(midiMessage.getChannel(), wheelValue);
+        pitchMessage.setTimeStamp(midiMessage.getTimeStamp());
+        emit(pitchMessage, samplePosition, advanceSamples);
+    };
+
+    if (midiMessage.isNoteOn()) {
+        auto noteNumber = midiMessage.getNoteNumber();
+        auto veolcity = midiMessage.getFloatVelocity();
 
-    if (noteMetadata.noteName == ToneNames::toneFSharp) {
-        toneValue = fSharpCents;
+        // queue noteOn
+        auto onMessage =  juce::MidiMessage::noteOn(1, noteNumber, veolcity);
+        onMessage.setTimeStamp(midiMessage.getTimeStamp());
+        emit(onMessage, samplePosition, 0);
+
+        heldNotes.noteOn(noteNumber);
+
+        // MIDI pitch adjustment message after each noteOn to make sure the pitch microtuning is in place.
+        // In lookahead mode, the bend arrives a guard interval before the note-on,
+        // so that the attack is already played at the tuned pitch
+        updateBend(guardSamples);
     }
 
-    if (noteMetadata.noteName == ToneNames::toneG) {
-        toneValue = gCents;
+    if (midiMessage.isPitchWheel()) {
+        inputPitchWheelValue = midiMessage.getPitchWheelValue();
+        updateBend(0);
     }
 
-    if (noteMetadata.noteName == ToneNames::toneGSharp) {
-        toneValue = gSharpCents;
+    if (midiMessage.isNoteOff()) {
+        auto noteNumber = midiMessage.getNoteNumber();
+        auto velocity = midiMessage.getFloatVelocity();
+
+        // queue noteOff
+        auto offMessage =  juce::MidiMessage::noteOff(1, noteNumber, velocity);
+        offMessage.setTimeStamp(midiMessage.getTimeStamp());
+        emit(offMessage, samplePosition, 0);
+
+        // when the owner is released, the bend goes back to the latest note still sounding
+        heldNotes.noteOff(noteNumber);
+        updateBend(0);
     }
 
-    if (noteMetadata.noteName == ToneNames::toneA) {
-        toneValue = aCents;
+    if (midiMessage.isSustainPedalOn() || midiMessage.isSustainPedalOff()) {
+        emit(midiMessage, samplePosition, 0);
+
+        heldNotes.setSustain(midiMessage.isSustainPedalOn());
+        updateBend(0);
     }
 
-    if (noteMetadata.noteName == ToneNames::toneASharp) {
-        toneValue = aSharpCents;
+    // all notes off (CC123) / all sound off (CC120): nothing sounds any more, even if note-offs went missing
+    if (midiMessage.isAllNotesOff() || midiMessage.isAllSoundOff()) {
+        emit(midiMessage, samplePosition, 0);
+
+        heldNotes.reset();
     }
+}
 
-    if (noteMetadata.noteName == ToneNames::toneB) {
-        toneValue = bCents;
+void AppAudioProcessor::resyncOutputMode()
+{
+    const int mode = outputMode;
+
+    if (mode == trackedOutputMode) {
+        return;
     }
 
-    auto nextWheelValue = (float) currentPitchWheelValue + (toneValue * kWheelValuePerCent);
+    trackedOutputMode = mode;
 
-    // hard limiting windowing for lower margin >= 0 upper margin <= 0x400
-    if (nextWheelValue < 0) return 0;
-    if (nextWheelValue >= 0x4000) return kWheelMaxValue;
+    // pass-through forwards notes and bends without tracking them, so after switching modes it's unknown
+    // which notes sound and which bend the synth has: tracking starts over and the next bend is always sent
+    heldNotes.reset();
+    sentPitchWheelValue = -1;
+}
 
-    return (int) nextWheelValue;
+void AppAudioProcessor::processMidiMessageNow(const juce::MidiMessage& midiMessage, juce::MidiBuffer& output)
+{
+    const juce::SpinLock::ScopedLockType lock (midiProcessingLock);
+
+    resyncOutputMode();
+
+    int sampleNumber = 0;
+
+    dispatchKernel(outputMode, bendRange, [&](auto mode, auto range) {
+        using OutputMode = decltype(mode);
+        using BendRange = decltype(range);
+
+        processMidiEvent<OutputMode, BendRange>(midiMessage, 0, 0, [&](const juce::MidiMessage& message, int, int) {
+            output.addEvent(message, sampleNumber);
+            sampleNumber++;
+        });
+    });
 }
 
-void AppAudioProcessor::processBlock(AudioSampleBuffer& buffer, MidiBuffer& midiBuffer)
+void AppAudioProcessor::processMidiEventsOnly(const juce::MidiBuffer& midiBuffer, juce::MidiBuffer& output, bool dispatchPerEvent)
 {
-   juce::MidiBuffer outputBuffer;
+    const juce::SpinLock::ScopedLockType lock (midiProcessingLock);
 
-   // PitchWheel has a range from 0 to 16384
-   // mean +- 2 semitones by general MIDI standard
-   // temperament
+    resyncOutputMode();
 
-   // clear all audio sample buffers
-   // we don't produce any audio nor do we filter incoming audio
-   buffer.clear();
+    if (! dispatchPerEvent) {
+        const BlockTiming timing { lookaheadSampleTime, 0, 0 };
+
+        dispatchKernel(outputMode, bendRange, [&](auto mode, auto range) {
+            processMidiEvents<decltype(mode), decltype(range), false>(midiBuffer, output, timing);
+        });
+
+        return;
+    }
 
     int sampleNumber = 0;
 
-    int currentPitchWheelValue = kWheelMiddlePosValue;
+    auto emit = [&](const juce::MidiMessage& message, int, int) {
+        output.addEvent(message, sampleNumber);
+        sampleNumber++;
+    };
 
     for (const auto midiBufferItem : midiBuffer) {
+        dispatchKernel(outputMode, bendRange, [&](auto mode, auto range) {
+            processMidiEvent<decltype(mode), decltype(range)>(midiBufferItem.getMessage(), midiBufferItem.samplePosition, 0, emit);
+        });
+    }
+}
+
+template <typename OutputMode, typename BendRange, bool Lookahead>
+void AppAudioProcessor::processMidiEvents(const juce::MidiBuffer& midiBuffer, juce::MidiBuffer& outputBuffer, const BlockTiming& timing)
+{
+    int sampleNumber = 0;
 
-        auto midiMessage = midiBufferItem.getMessage();
+    // in lookahead mode, events are delayed by the latency and the ones with an advance are moved ahead of
+    // the others by that many samples; otherwise they are sent in order right away
+    auto emit = [&](const juce::MidiMessage& message, int samplePosition, int advanceSamples) {
+        if (Lookahead) {
+            // queue times never decrease, so that the stream keeps its order when the latency shrinks
+            auto time = juce::jmax(timing.blockStartTime + samplePosition + timing.latencySamples, lastQueuedTime);
+            auto scheduledTime = time - advanceSamples;
+            lastQueuedTime = time;
+
+            // an advanced bend still goes after every bend queued before it (e.g. of a pedal-up or a
+            // note-off on the same tick), which would override it otherwise
+            if (message.isPitchWheel()) {
+                scheduledTime = juce::jmin(time, juce::jmax(scheduledTime, lastQueuedBendTime));
+                lastQueuedBendTime = scheduledTime;
+            }
 
-        if (midiMessage.isNoteOn()) {
+            // an event must never skip the delay, that would reorder the stream (e.g. a note-off before
+            // its note-on). If the queue is full, the event is dropped
+            auto queued = lookaheadQueue.push(message, scheduledTime);
+            jassert (queued);
+            ignoreUnused (queued);
+            return;
+        }
 
-            currentNotePlayed = getNoteMetadata(midiBufferItem.getMessage().getNoteNumber());
+        outputBuffer.addEvent(message, sampleNumber);
+        sampleNumber++;
+    };
 
+    for (const auto midiBufferItem : midiBuffer) {
+        processMidiEvent<OutputMode, BendRange>(midiBufferItem.getMessage(), midiBufferItem.samplePosition, timing.guardSamples, emit);
+    }
+}
+
+void AppAudioProcessor::processBlock(AudioSampleBuffer& buffer, MidiBuffer& midiBuffer)
+{
+   // standalone MIDI-thru mode: the MIDI router processes events on its own thread as they arrive, so the
+   // MIDI of the audio callback (from the inputs of the audio settings) is dropped. What's left in the
+   // lookahead queue is sent once, nothing else is needed here
+   if (midiRouter != nullptr && midiRouter->isRunning()) {
+       midiBuffer.clear();
 
+       {
+           const juce::SpinLock::ScopedLockType lock (midiProcessingLock);
+           flushLookaheadQueue(midiBuffer);
+       }
 
+       // calibration can run alongside (this returns right away otherwise). The standalone player
+       // zeroes the output channels that carry no input, so only enabled input channels need clearing
+       pitchCalibrator->pushSamples(buffer, getTotalNumInputChannels());
 
-            auto noteNumber = midiMessage.getNoteNumber();
-            auto veolcity = midiMessage.getFloatVelocity();
+       for (int channel = 0; channel < getTotalNumInputChannels(); channel++)
+           buffer.clear(channel, 0, buffer.getNumSamples());
 
-            // queue noteOn
-            auto onMessage =  juce::MidiMessage::noteOn(1, noteNumber, veolcity);
-            onMessage.setTimeStamp(midiMessage.getTimeStamp());
-            outputBuffer.addEvent(onMessage, sampleNumber);
+       return;
+   }
 
-            sampleNumber++;
+   juce::MidiBuffer outputBuffer;
 
-            currentPitchWheelValue = calculatePitchWheelValue(currentNotePlayed, currentPitchWheelValue);
+   // PitchWheel has a range from 0 to 16384
+   // mean +- 2 semitones by general MIDI standard
+   // temperament
 
-            // MIDI pitch adjustment message after each noteOn to make sure the pitch microtuning is in place
-            auto pitchAdjustmentMessage = juce::MidiMessage::pitchWheel(midiMessage.getChannel(), currentPitchWheelValue);
-            pitchAdjustmentMessage.setTimeStamp(midiMessage.getTimeStamp());
-            outputBuffer.addEvent(pitchAdjustmentMessage, sampleNumber);
+   // calibration mode: the incoming audio is analysed on the calibration thread
+   pitchCalibrator->pushSamples(buffer, getTotalNumInputChannels());
 
-            sampleNumber++;
-        }
+   // clear all audio sample buffers
+   // we don't produce any audio nor do we filter incoming audio
+   buffer.clear();
 
-        if (midiBufferItem.getMessage().isPitchWheel()) {
+    const juce::SpinLock::ScopedLockType lock (midiProcessingLock);
 
-            auto newPitchWheelValue = midiBufferItem.getMessage().getPitchWheelValue();
-            //pitchBendPercent = currentPitchWheelValue / kHighResolutionMax; // 0.5 -> mid, 0 -> low, 1 -> high
-            int relativePitchWheelNoteDifference = 0;
+    resyncOutputMode();
 
-            if (currentNotePlayed.isDefined) {
-                relativePitchWheelNoteDifference = calculatePitchWheelValue(currentNotePlayed, kWheelMiddlePosValue) - kWheelMiddlePosValue;
-            }
-            currentPitchWheelValue = newPitchWheelValue + relativePitchWheelNoteDifference;
+    // lookahead mode: the reported latency changes with the lookahead settings
+    const bool lookahead = lookaheadEnabled && lookaheadSamples > 0;
+    const int latencySamples = lookahead ? lookaheadSamples : 0;
 
-            auto pitchMessage = juce::MidiMessage::pitchWheel(
-                    midiBufferItem.getMessage().getChannel(),
-                // every pitch wheel movement must add the microtuning difference to be relatively correct
-                    currentPitchWheelValue
-            );
-            pitchMessage.setTimeStamp(midiBufferItem.getMessage().getTimeStamp());
-            outputBuffer.addEvent(pitchMessage, sampleNumber);
+    // the host is told on the message thread (see handleAsyncUpdate)
+    if (latencySamples != reportedLatencySamples) {
+        reportedLatencySamples = latencySamples;
+        triggerAsyncUpdate();
+    }
 
-            sampleNumber++;
-        }
+    const auto blockStartTime = lookaheadSampleTime;
+    const auto blockEndTime = blockStartTime + buffer.getNumSamples();
 
-        if (midiBufferItem.getMessage().isNoteOff()) {
-            auto noteNumber = midiBufferItem.getMessage().getNoteNumber();
-            auto velocity = midiBufferItem.getMessage().getFloatVelocity();
+    // never schedule a bend earlier than the block it was played in
+    const int guardSamples = juce::jmin(lookaheadGuardSamples, latencySamples);
 
-            // queue noteOff
-            auto offMessage =  juce::MidiMessage::noteOff(1, noteNumber, velocity);
-            offMessage.setTimeStamp(midiBufferItem.getMessage().getTimeStamp());
-            outputBuffer.addEvent(offMessage, sampleNumber);
+    const BlockTiming timing { blockStartTime, latencySamples, guardSamples };
 
-            // reset pitch wheel
-            //currentPitchWheelValue = kWheelMiddlePosValue;
+    // picking the specialised kernel once for the whole block
+    dispatchKernel(outputMode, bendRange, [&](auto mode, auto range) {
+        using OutputMode = decltype(mode);
+        using BendRange = decltype(range);
 
-            sampleNumber++;
+        if (lookahead) {
+            processMidiEvents<OutputMode, BendRange, true>(midiBuffer, outputBuffer, timing);
+        } else {
+            processMidiEvents<OutputMode, BendRange, false>(midiBuffer, outputBuffer, timing);
         }
-    }
+    });
 
     // clear incoming messages - output shall be defined by the plugin only
     midiBuffer.clear();
 
-    sampleNumber = 0;
+    if (lookahead) {
+        // sending everything that is due within this block
+        const int lastSample = juce::jmax(0, buffer.getNumSamples() - 1);
+
+        lookaheadQueue.popUntil(blockEndTime, [&](const juce::uint8* data, int size, juce::int64 time) {
+            midiBuffer.addEvent(data, size, (int) juce::jlimit<juce::int64>(0, lastSample, time - blockStartTime));
+        });
+    } else {
+        // lookahead has just been switched off: whatever is still queued was played before this block,
+        // so it's flushed first, at sample 0, and no queued note-off can end a note of this block
+        flushLookaheadQueue(midiBuffer);
+    }
+
+    int sampleNumber = 0;
 
     // re-adding to the buffer in the right order
     for (const auto midiMessage : outputBuffer) {
         sampleNumber++;
         midiBuffer.addEvent(midiMessage.getMessage(), sampleNumber);
     }
+
+    lookaheadSampleTime = blockEndTime;
 }
 
-void AppAudioProcessor::parameterChanged (const juce::String& paramId, float newValue)
+void AppAudioProcessor::handleAsyncUpdate()
 {
-    if (paramId == ParamIDs::cCents) {
-        cCents = newValue;
-    }
-
-    if (paramId == ParamIDs::cSharpCents) {
-        cSharpCents = newValue;
-    }
-
-    if (paramId == ParamIDs::dCents) {
-        dCents = newValue;
-    }
-
-    if (paramId == ParamIDs::dSharpCents) {
-        dSharpCents = newValue;
-    }
-
-    if (paramId == ParamIDs::eCents) {
-        eCents = newValue;
-    }
-
-    if (paramId == ParamIDs::fCents) {
-        fCents = newValue;
-    }
+    setLatencySamples(reportedLatencySamples);
+}
 
-    if (paramId == ParamIDs::fSharpCents) {
-        fSharpCents = newValue;
-    }
+void AppAudioProcessor::flushLookaheadQueue(juce::MidiBuffer& midiBuffer)
+{
+    lookaheadQueue.popUntil(std::numeric_limits<juce::int64>::max(), [&](const juce::uint8* data, int size, juce::int64) {
+        midiBuffer.addEvent(data, size, 0);
+    });
+}
 
-    if (paramId == ParamIDs::gCents) {
-        gCents = newValue;
+void AppAudioProcessor::parameterChanged (const juce::String& paramId, float newValue)
+{
+    for (int i = 0; i < numElementsInArray (kToneParamIDs); i++) {
+        if (paramId == *kToneParamIDs[i]) {
+            tuningTable[i] = newValue;
+        }
     }
 
-    if (paramId == ParamIDs::gSharpCents) {
-        gSharpCents = newValue;
+    if (paramId == ParamIDs::lookahead) {
+        lookaheadEnabled = newValue >= 0.5f;
     }
 
-    if (paramId == ParamIDs::aCents) {
-        aCents = newValue;
+    if (paramId == ParamIDs::lookaheadSamples) {
+        lookaheadSamples = (int) newValue;
     }
 
-    if (paramId == ParamIDs::aSharpCents) {
-        aSharpCents = newValue;
+    if (paramId == ParamIDs::outputMode) {
+        outputMode = (int) newValue;
     }
 
-    if (paramId == ParamIDs::bCents) {
-        bCents = newValue;
+    if (paramId == ParamIDs::bendRange) {
+        bendRange = (int) newValue;
     }
 }
 
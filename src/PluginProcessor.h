@@ -12,17 +12,17 @@
 #ifndef PLUGINPROCESSOR_H_INCLUDED
 #define PLUGINPROCESSOR_H_INCLUDED
 
-struct NoteMetadata {
-    bool isDefined;
-    int octave;
-    std::string noteName;
-    int noteNumber;
-};
+#include "HeldNotes.h"
+#include "MidiEventQueue.h"
+#include "OutputModes.h"
+#include "MidiRouter.h"
+#include "PitchCalibrator.h"
 
 class PresetListBox;
 
 class AppAudioProcessor : public foleys::MagicProcessor,
-                          private juce::AudioProcessorValueTreeState::Listener
+                          private juce::AudioProcessorValueTreeState::Listener,
+                          private juce::AsyncUpdater
 {
 public:
    AppAudioProcessor();
@@ -30,6 +30,7 @@ public:
    
     void prepareToPlay (double sampleRate, int samplesPerBlock) override;
     void releaseResources() override;
+    void reset() override;
    #ifndef JucePlugin_PreferredChannelConfigurations
     bool isBusesLayoutSupported(const BusesLayout& layouts) const override;
    #endif
@@ -40,9 +41,13 @@ public:
     void setCurrentProgram (int index) override;
     const String getProgramName (int index) override;
     void changeProgramName (int index, const String& newName) override;
+    void getStateInformation (juce::MemoryBlock& destData) override;
+    void setStateInformation (const void* data, int sizeInBytes) override;
     void parameterChanged (const juce::String& parameterID, float newValue) override;
-    NoteMetadata getNoteMetadata(int midiNoteNumber);
-    int calculatePitchWheelValue(NoteMetadata& noteMetadata, int currentPitchWheelValue);
+
+    // tunes a single message right away and appends the result to output, without any
+    // block context. Used by the MidiRouter, which calls it on its MIDI thread
+    void processMidiMessageNow(const juce::MidiMessage& midiMessage, juce::MidiBuffer& output);
 
     // In this override you create the GUI ValueTree either using the default or loading from the BinaryData::magic_xml
     juce::ValueTree createGuiValueTree() override;
@@ -58,26 +63,100 @@ public:
    AudioParameterFloat *mDummyParam;
    
 private:
+    // audioapp_bench drives the kernel directly
+    friend struct BenchmarkAccess;
+
+    // runs only the event processing kernel (no lookahead) and appends the results to output. With
+    // dispatchPerEvent, output mode and bend range are checked for every event, as a baseline for the
+    // kernels specialised per block
+    void processMidiEventsOnly(const juce::MidiBuffer& midiBuffer, juce::MidiBuffer& output, bool dispatchPerEvent);
+
     juce::AudioProcessorValueTreeState treeState { *this, nullptr };
 
     juce::ValueTree presetNode;
     PresetListBox* presetList = nullptr;
-    int currentPresetIndexSelected;
-
-    float cCents;
-    float cSharpCents;
-    float dCents;
-    float dSharpCents;
-    float eCents;
-    float fCents;
-    float fSharpCents;
-    float gCents;
-    float gSharpCents;
-    float aCents;
-    float aSharpCents;
-    float bCents;
-
-    NoteMetadata currentNotePlayed;
+    int currentPresetIndexSelected = -1;
+
+    // active tuning table, cents per pitch class starting at C
+    float tuningTable[12];
+
+    // indices of the OutputModes and BendRanges policies
+    int outputMode;
+    int bendRange;
+
+    // output mode the MIDI state below was tracked in (see resyncOutputMode)
+    int trackedOutputMode;
+
+    // lookahead mode: the MIDI stream is delayed by lookaheadSamples (reported as latency),
+    // so that each bend can be sent a guard interval before its note-on
+    bool lookaheadEnabled;
+    int lookaheadSamples;
+    int lookaheadGuardSamples = 0;
+
+    // time-sorted delayed events, carried across block boundaries
+    MidiEventQueue lookaheadQueue;
+
+    // absolute sample time of the start of the next block
+    juce::int64 lookaheadSampleTime = 0;
+
+    // latest times an event and a bend were queued for, queue times never go back
+    juce::int64 lastQueuedTime = 0;
+    juce::int64 lastQueuedBendTime = 0;
+
+    // the latency processBlock works with, reported to the host on the message thread
+    std::atomic<int> reportedLatencySamples { 0 };
+
+    // held and sustained notes, deciding which note owns the bend
+    HeldNotes heldNotes;
+
+    // pitch wheel position as played, and the tuned value last sent (-1 if none yet)
+    int inputPitchWheelValue;
+    int sentPitchWheelValue = -1;
+
+    // standalone MIDI-thru mode, only exists in the standalone app
+    std::unique_ptr<MidiRouter> midiRouter;
+
+    // calibration mode, measures the tuning of a real instrument played into the audio input
+    std::unique_ptr<PitchCalibrator> pitchCalibrator;
+
+    // the router and the audio thread never tune at the same time
+    juce::SpinLock midiProcessingLock;
+
+    struct BlockTiming
+    {
+        juce::int64 blockStartTime;
+        int latencySamples;
+        int guardSamples;
+    };
+
+    // the processing kernel, specialised at compile time by output mode, bend range and lookahead (see OutputModes.h)
+    template <typename OutputMode, typename BendRange, bool Lookahead>
+    void processMidiEvents(const juce::MidiBuffer& midiBuffer, juce::MidiBuffer& outputBuffer, const BlockTiming& timing);
+
+    // tunes one incoming message and hands the resulting messages to emit (message, samplePosition, advanceSamples)
+    template <typename OutputMode, typename BendRange, typename Emit>
+    void processMidiEvent(const juce::MidiMessage& midiMessage, int samplePosition, int guardSamples, Emit&& emit);
+
+    // starts the note and bend tracking over when the output mode has changed since the last events
+    void resyncOutputMode();
+
+    // reports a changed latency to the host
+    void handleAsyncUpdate() override;
+
+    // drops everything from the lookahead queue but note-offs and releases, which are sent at the given time
+    void keepPendingNoteOffs(juce::int64 time);
+
+    // adds everything still in the lookahead queue to midiBuffer at sample 0
+    void flushLookaheadQueue(juce::MidiBuffer& midiBuffer);
+
+    template <typename BendRange>
+    int calculatePitchWheelValue(int noteNumber, int currentPitchWheelValue) const;
+
+    // sets a parameter from its denormalised (plain) value, e.g. when restoring state
+    void setParameterPlainValue(const juce::String& paramId, float plainValue);
+
+    // index of the preset with the given name in the shared preset list, or -1
+    int findPresetIndex(const juce::String& name);
 
    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AppAudioProcessor)
 };